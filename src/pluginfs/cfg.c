@@ -22,12 +22,16 @@
 enum plgfs_options {
 	opt_plgs,
 	opt_fstype,
+	opt_pagecache,
+	opt_readdirplus,
 	opt_hidden
 };
 
 static match_table_t plgfs_tokens = {
 	{opt_plgs, "plugins=%s"},
 	{opt_fstype, "fstype=%s"},
+	{opt_pagecache, "pagecache"},
+	{opt_readdirplus, "readdirplus"},
 	{opt_hidden, NULL}
 };
 
@@ -73,6 +77,14 @@ static int plgfs_parse_options(char *opts, struct plgfs_mnt_cfg *cfg)
 					return -ENOMEM;
 				break;
 
+			case opt_pagecache:
+				cfg->flags |= PLGFS_OPT_PAGECACHE;
+				break;
+
+			case opt_readdirplus:
+				cfg->flags |= PLGFS_OPT_READDIRPLUS;
+				break;
+
 			case opt_hidden:
 				plgfs_pass_on_option(opt, cfg->opts);
 				break;
@@ -88,22 +88,29 @@ error:
 	return rv;
 }
 
+static void plgfs_di_callback(struct rcu_head *head)
+{
+	struct plgfs_dentry_info *di;
+
+	di = container_of(head, struct plgfs_dentry_info, rcu);
+
+	kmem_cache_free(di->cache, di);
+}
+
 static void plgfs_d_release(struct dentry *d)
 {
 	struct plgfs_context *cont;
 	struct plgfs_sb_info *sbi;
-	struct plgfs_dentry_info *dpi; /* dentry parent info */
 	struct plgfs_dentry_info *di; /* dentry info */
 
 	di = plgfs_di(d);
-	dpi = plgfs_di(d->d_parent);
 	sbi = plgfs_sbi(d->d_sb);
 	cont = plgfs_alloc_context(sbi);
 	if (IS_ERR(cont)) {
 		/* try to at least free the resources*/
 		if (!IS_ROOT(d))
 			dput(plgfs_dh(d));
-		kmem_cache_free(sbi->cache->di_cache, di);
+		call_rcu(&di->rcu, plgfs_di_callback);
 		pr_err("pluginfs: cannot alloc context for dentry release, no"
 				"plugins will be called\n");
 		return;
@@ -118,20 +125,48 @@ static void plgfs_d_release(struct dentry *d)
 
 	plgfs_postcall_plgs(cont, sbi);
 
-	kmem_cache_free(sbi->cache->di_cache, di);
+	call_rcu(&di->rcu, plgfs_di_callback);
 
 	plgfs_free_context(sbi, cont);
 }
 
-static int plgfs_d_revalidate(struct dentry *d, unsigned int flags)
+static int plgfs_d_revalidate_hidden(struct dentry *d, unsigned int flags)
+{
+	struct dentry *dh;
+
+	dh = plgfs_dh(d);
+	if (!(dh->d_flags & DCACHE_OP_REVALIDATE))
+		return 1;
+
+	return dh->d_op->d_revalidate(dh, flags);
+}
+
+/*
+ * In rcu-walk neither we nor the plugins may block. Without callbacks for
+ * revalidate the hidden dentry is checked directly, otherwise the per cpu
+ * context is used, unless some plugin asked for ref-walk.
+ */
+static int plgfs_d_revalidate_plgs(struct dentry *d, unsigned int flags)
 {
 	struct plgfs_context *cont;
 	struct plgfs_sb_info *sbi;
-	struct dentry *dh;
+	int rcu;
 	int rv;
 
 	sbi = plgfs_sbi(d->d_sb);
-	cont = plgfs_alloc_context_atomic(sbi);
+
+	if (!plgfs_has_cbs(sbi, PLGFS_DOP_D_REVALIDATE))
+		return plgfs_d_revalidate_hidden(d, flags);
+
+	rcu = flags & LOOKUP_RCU;
+	if (rcu && (sbi->flags & PLGFS_SBI_NO_RCU))
+		return -ECHILD;
+
+	if (rcu)
+		cont = plgfs_get_context_rcu(sbi);
+	else
+		cont = plgfs_alloc_context(sbi);
+
 	if (IS_ERR(cont))
 		return PTR_ERR(cont);
 
@@ -145,34 +180,97 @@ static int plgfs_d_revalidate(struct dentry *d, unsigned int flags)
 	d = cont->op_args.d_revalidate.dentry;
 	flags = cont->op_args.d_revalidate.flags;
 
-	dh = plgfs_dh(d);
-	cont->op_rv.rv_int = 1;
-	if (!(dh->d_flags & DCACHE_OP_REVALIDATE))
-		goto postcalls;
-
-	cont->op_rv.rv_int = dh->d_op->d_revalidate(dh, flags);
+	cont->op_rv.rv_int = plgfs_d_revalidate_hidden(d, flags);
 
 postcalls:
 	plgfs_postcall_plgs(cont, sbi);
 
 	rv = cont->op_rv.rv_int;
 
-	plgfs_free_context(sbi, cont);
+	if (rcu)
+		plgfs_put_context_rcu(sbi);
+	else
+		plgfs_free_context(sbi, cont);
 
 	return rv;
 }
 
+/*
+ * A negative dentry remembers the generation of the hidden parent directory
+ * from the time the name was known to be missing. While the directory did
+ * not change and the hidden dentry is still negative, the dentry is valid
+ * without running the plugins. Returns 1 for valid, 0 when the name appeared
+ * in the hidden fs and -1 when the dentry has to be revalidated fully.
+ */
+static int plgfs_d_neg_check(struct dentry *d, struct plgfs_dir_gen *gen)
+{
+	struct plgfs_dentry_info *di;
+	struct dentry *dh;
+
+	di = plgfs_di(d);
+	dh = di->dentry_hidden;
+
+	plgfs_get_dir_gen(ACCESS_ONCE(dh->d_parent)->d_inode, gen);
+	smp_rmb();
+
+	if (ACCESS_ONCE(dh->d_inode) || d_unhashed(dh))
+		return 0;
+
+	if (!di->neg || !plgfs_dir_gen_eq(&di->neg_gen, gen))
+		return -1;
+
+	return 1;
+}
+
+static int plgfs_d_revalidate(struct dentry *d, unsigned int flags)
+{
+	struct plgfs_dir_gen gen;
+	int rv;
+
+	if (ACCESS_ONCE(d->d_inode))
+		return plgfs_d_revalidate_plgs(d, flags);
+
+	rv = plgfs_d_neg_check(d, &gen);
+	if (rv > 0)
+		return plgfs_d_revalidate_hidden(d, flags);
+
+	if (!rv)
+		return 0;
+
+	rv = plgfs_d_revalidate_plgs(d, flags);
+
+	/* concurrent rcu walkers would race on the update */
+	if (rv > 0 && !(flags & LOOKUP_RCU)) {
+		plgfs_di(d)->neg_gen = gen;
+		plgfs_di(d)->neg = 1;
+	}
+
+	return rv;
+}
+
+static int plgfs_d_hash_hidden(const struct dentry *d, struct qstr *s)
+{
+	struct dentry *dh;
+
+	dh = plgfs_dh((struct dentry *)d);
+	if (!(dh->d_flags & DCACHE_OP_HASH))
+		return 0;
+
+	return dh->d_op->d_hash(dh, s);
+}
+
 static int plgfs_d_hash(const struct dentry *d, struct qstr *s)
 {
 	struct plgfs_context *cont;
 	struct plgfs_sb_info *sbi;
-	struct dentry *dh;
 	int rv;
 
 	sbi = plgfs_sbi(d->d_sb);
-	cont = plgfs_alloc_context_atomic(sbi);
-	if (IS_ERR(cont))
-		return PTR_ERR(cont);
+
+	if (!plgfs_has_cbs(sbi, PLGFS_DOP_D_HASH))
+		return plgfs_d_hash_hidden(d, s);
+
+	cont = plgfs_get_context_rcu(sbi);
 
 	cont->op_id = PLGFS_DOP_D_HASH;
 	cont->op_args.d_hash.dentry = d;
@@ -184,36 +282,51 @@ static int plgfs_d_hash(const struct dentry *d, struct qstr *s)
 	d = cont->op_args.d_hash.dentry;
 	s = cont->op_args.d_hash.str;
 
-	dh = plgfs_dh((struct dentry *)d);
-	cont->op_rv.rv_int = 0;
-	if (!(dh->d_flags & DCACHE_OP_HASH))
-		goto postcalls;
-
-	cont->op_rv.rv_int = dh->d_op->d_hash(dh, s);
+	cont->op_rv.rv_int = plgfs_d_hash_hidden(d, s);
 
 postcalls:
 	plgfs_postcall_plgs(cont, sbi);
 
 	rv = cont->op_rv.rv_int;
 
-	plgfs_free_context(sbi, cont);
+	plgfs_put_context_rcu(sbi);
 
 	return rv;
 }
 
+static int plgfs_d_compare_hidden(const struct dentry *dp,
+		const struct dentry *d, unsigned int len, const char *str,
+		const struct qstr *name)
+{
+	const struct dentry *dh;
+	const struct dentry *dph;
+
+	dph = plgfs_dh((struct dentry *)dp);
+	dh = plgfs_dh((struct dentry *)d);
+
+	if (!(dh->d_flags & DCACHE_OP_COMPARE)) {
+		if (len != name->len)
+			return 1;
+
+		return strncmp(str, name->name, len);
+	}
+
+	return dph->d_op->d_compare(dph, dh, len, str, name);
+}
+
 static int plgfs_d_compare(const struct dentry *dp, const struct dentry *d,
 		unsigned int len, const char *str, const struct qstr *name)
 {
 	struct plgfs_context *cont;
 	struct plgfs_sb_info *sbi;
-	const struct dentry *dh;
-	const struct dentry *dph;
 	int rv;
 
 	sbi = plgfs_sbi(d->d_sb);
-	cont = plgfs_alloc_context_atomic(sbi);
-	if (IS_ERR(cont))
-		return PTR_ERR(cont);
+
+	if (!plgfs_has_cbs(sbi, PLGFS_DOP_D_COMPARE))
+		return plgfs_d_compare_hidden(dp, d, len, str, name);
+
+	cont = plgfs_get_context_rcu(sbi);
 
 	cont->op_id = PLGFS_DOP_D_COMPARE;
 	cont->op_args.d_compare.parent = dp;
@@ -231,28 +344,14 @@ static int plgfs_d_compare(const struct dentry *dp, const struct dentry *d,
 	str = cont->op_args.d_compare.str;
 	name = cont->op_args.d_compare.name;
 
-	dph = plgfs_dh((struct dentry *)dp);
-	dh = plgfs_dh((struct dentry *)d);
-
-	if (!(dh->d_flags & DCACHE_OP_COMPARE)) {
-		cont->op_rv.rv_int = 1;
-
-		if (len != name->len)
-			goto postcalls;
-
-		cont->op_rv.rv_int = strncmp(str, name->name, len);
-		goto postcalls;
-	}
-
-	cont->op_rv.rv_int = dph->d_op->d_compare(dph, dh, len, str,
-			name);
+	cont->op_rv.rv_int = plgfs_d_compare_hidden(dp, d, len, str, name);
 
 postcalls:
 	plgfs_postcall_plgs(cont, sbi);
 
 	rv = cont->op_rv.rv_int;
 
-	plgfs_free_context(sbi, cont);
+	plgfs_put_context_rcu(sbi);
 
 	return rv;
 }
@@ -264,6 +363,56 @@ const struct dentry_operations plgfs_dops = {
 	.d_compare = plgfs_d_compare,
 };
 
+static const struct dentry_operations plgfs_dops_revalidate = {
+	.d_release = plgfs_d_release,
+	.d_revalidate = plgfs_d_revalidate,
+};
+
+static const struct dentry_operations plgfs_dops_name = {
+	.d_release = plgfs_d_release,
+	.d_hash = plgfs_d_hash,
+	.d_compare = plgfs_d_compare,
+};
+
+static const struct dentry_operations plgfs_dops_release = {
+	.d_release = plgfs_d_release,
+};
+
+/*
+ * Every dentry op we set makes the dcache call us, so only ops needed by the
+ * hidden fs, judged by its root dentry, or by some plugin are set. Without
+ * d_hash and d_compare the dcache uses its own inline hash and compare.
+ * Filesystems without a block device, like proc, may set d_op per dentry,
+ * so they always get the full table.
+ */
+const struct dentry_operations *plgfs_get_dops(struct plgfs_sb_info *sbi,
+		struct dentry *drh)
+{
+	int revalidate;
+	int name;
+
+	if (!drh->d_sb->s_bdev)
+		return &plgfs_dops;
+
+	revalidate = (drh->d_flags & DCACHE_OP_REVALIDATE) ||
+		plgfs_has_cbs(sbi, PLGFS_DOP_D_REVALIDATE);
+
+	name = (drh->d_flags & (DCACHE_OP_HASH | DCACHE_OP_COMPARE)) ||
+		plgfs_has_cbs(sbi, PLGFS_DOP_D_HASH) ||
+		plgfs_has_cbs(sbi, PLGFS_DOP_D_COMPARE);
+
+	if (revalidate && name)
+		return &plgfs_dops;
+
+	if (revalidate)
+		return &plgfs_dops_revalidate;
+
+	if (name)
+		return &plgfs_dops_name;
+
+	return &plgfs_dops_release;
+}
+
 struct plgfs_dentry_info *plgfs_alloc_di(struct dentry *d)
 {
 	struct plgfs_sb_info *sbi;
@@ -276,6 +425,7 @@ struct plgfs_dentry_info *plgfs_alloc_di(struct dentry *d)
 		return ERR_PTR(-ENOMEM);
 
 	INIT_LIST_HEAD(&di->list_walk);
+	di->cache = sbi->cache->di_cache;
 
 	return di;
 }
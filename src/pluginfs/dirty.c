@@ -0,0 +1,214 @@
+/*
+ * Copyright 2013 Frantisek Hrbata <fhrbata@pluginfs.org>
+ *
+ * This file is part of PluginFS.
+ *
+ * PluginFS is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * PluginFS is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with PluginFS.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "plgfs.h"
+
+/*
+ * Byte ranges written to a regular file are kept per inode in a sorted list
+ * of disjoint ranges. Touching or overlapping ranges are merged and once
+ * there are PLGFS_DIRTY_MAX of them, a new range widens its nearest
+ * neighbour instead, so the list stays short at the cost of precision.
+ */
+#define PLGFS_DIRTY_MAX 64
+
+struct plgfs_dirty {
+	struct list_head list;
+	loff_t start;
+	loff_t end;
+};
+
+static void plgfs_dirty_merge_next(struct plgfs_inode_info *ii,
+		struct plgfs_dirty *d)
+{
+	struct plgfs_dirty *next;
+
+	while (d->list.next != &ii->dirty) {
+		next = list_entry(d->list.next, struct plgfs_dirty, list);
+		if (next->start > d->end)
+			break;
+
+		d->end = max(d->end, next->end);
+		list_del(&next->list);
+		kfree(next);
+		ii->dirty_nr--;
+	}
+}
+
+static void plgfs_dirty_widen(struct plgfs_inode_info *ii,
+		struct plgfs_dirty *d, loff_t start, loff_t end)
+{
+	struct plgfs_dirty *prev;
+
+	prev = NULL;
+	if (d->list.prev != &ii->dirty)
+		prev = list_entry(d->list.prev, struct plgfs_dirty, list);
+
+	if (&d->list == &ii->dirty)
+		d = NULL;
+
+	if (prev && (!d || start - prev->end <= d->start - end))
+		prev->end = end;
+	else
+		d->start = start;
+}
+
+/*
+ * Most writes extend or fall into a range already recorded, a new range is
+ * allocated only when it really has to be inserted.
+ */
+void plgfs_dirty_add(struct inode *i, loff_t start, loff_t end)
+{
+	struct plgfs_inode_info *ii;
+	struct plgfs_dirty *new;
+	struct plgfs_dirty *d;
+	int nomem;
+
+	if (!(plgfs_sbi(i->i_sb)->flags & PLGFS_SBI_TRACK_DIRTY))
+		return;
+
+	if (start >= end)
+		return;
+
+	ii = plgfs_ii(i);
+	new = NULL;
+	nomem = 0;
+again:
+	spin_lock(&ii->dirty_lock);
+
+	list_for_each_entry(d, &ii->dirty, list) {
+		if (d->end >= start)
+			break;
+	}
+
+	if (&d->list != &ii->dirty && d->start <= end) {
+		d->start = min(d->start, start);
+		d->end = max(d->end, end);
+		plgfs_dirty_merge_next(ii, d);
+		goto unlock;
+	}
+
+	if (ii->dirty_nr >= PLGFS_DIRTY_MAX) {
+		plgfs_dirty_widen(ii, d, start, end);
+		goto unlock;
+	}
+
+	if (!new && !nomem) {
+		spin_unlock(&ii->dirty_lock);
+
+		new = kmalloc(sizeof(struct plgfs_dirty), GFP_NOFS);
+		nomem = !new;
+
+		goto again;
+	}
+
+	if (!new && list_empty(&ii->dirty)) {
+		ii->dirty_lost = 1;
+		goto unlock;
+	}
+
+	if (!new) {
+		plgfs_dirty_widen(ii, d, start, end);
+		goto unlock;
+	}
+
+	new->start = start;
+	new->end = end;
+	list_add_tail(&new->list, &d->list);
+	ii->dirty_nr++;
+	new = NULL;
+unlock:
+	spin_unlock(&ii->dirty_lock);
+
+	kfree(new);
+}
+
+void plgfs_dirty_lost(struct inode *i)
+{
+	struct plgfs_inode_info *ii;
+
+	ii = plgfs_ii(i);
+
+	spin_lock(&ii->dirty_lock);
+	ii->dirty_lost = 1;
+	spin_unlock(&ii->dirty_lock);
+}
+
+/*
+ * Copies up to nr ranges written since the last plgfs_clear_dirty_ranges and
+ * returns the number of all of them. -EOVERFLOW means some writes could not
+ * be recorded and the whole file has to be considered modified.
+ */
+int plgfs_get_dirty_ranges(struct inode *i, struct plgfs_range *r, int nr)
+{
+	struct plgfs_inode_info *ii;
+	struct plgfs_dirty *d;
+	int rv;
+
+	if (i->i_sb->s_magic != PLGFS_MAGIC || !S_ISREG(i->i_mode))
+		return -EINVAL;
+
+	ii = plgfs_ii(i);
+	rv = 0;
+
+	spin_lock(&ii->dirty_lock);
+
+	if (ii->dirty_lost) {
+		rv = -EOVERFLOW;
+		goto unlock;
+	}
+
+	list_for_each_entry(d, &ii->dirty, list) {
+		if (rv < nr) {
+			r[rv].start = d->start;
+			r[rv].end = d->end;
+		}
+		rv++;
+	}
+unlock:
+	spin_unlock(&ii->dirty_lock);
+
+	return rv;
+}
+
+void plgfs_clear_dirty_ranges(struct inode *i)
+{
+	LIST_HEAD(list);
+	struct plgfs_inode_info *ii;
+	struct plgfs_dirty *d;
+	struct plgfs_dirty *tmp;
+
+	if (i->i_sb->s_magic != PLGFS_MAGIC)
+		return;
+
+	ii = plgfs_ii(i);
+
+	spin_lock(&ii->dirty_lock);
+	list_splice_init(&ii->dirty, &list);
+	ii->dirty_nr = 0;
+	ii->dirty_lost = 0;
+	spin_unlock(&ii->dirty_lock);
+
+	list_for_each_entry_safe(d, tmp, &list, list) {
+		list_del(&d->list);
+		kfree(d);
+	}
+}
+
+EXPORT_SYMBOL(plgfs_get_dirty_ranges);
+EXPORT_SYMBOL(plgfs_clear_dirty_ranges);
@@ -0,0 +1,300 @@
+/*
+ * Copyright 2013 Frantisek Hrbata <fhrbata@pluginfs.org>
+ *
+ * This file is part of PluginFS.
+ *
+ * PluginFS is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * PluginFS is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with PluginFS.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "plgfs.h"
+
+/*
+ * Read-only hidden files of regular files are not closed with our file but
+ * kept for PLGFS_FCACHE_TTL, so a following open with the same flags and
+ * equivalent credentials can reuse them instead of opening a new one. Each
+ * inode keeps at most PLGFS_FCACHE_INODE_MAX of them. All entries of a sb are
+ * also on its LRU list, oldest first, which the expiry work and the sb
+ * shrinker free from. Both lists are protected by fcache_lock in sbi.
+ */
+#define PLGFS_FCACHE_TTL (5 * HZ)
+#define PLGFS_FCACHE_INODE_MAX 4
+
+struct plgfs_fcache {
+	struct list_head list; /* in inode */
+	struct list_head lru; /* in sb */
+	struct file *file;
+	const struct cred *cred;
+	unsigned long expire;
+	struct plgfs_inode_info *ii;
+};
+
+/*
+ * The LSM label is compared by its blob pointer. This is stricter than
+ * needed, but a file opened under another label is never reused.
+ */
+static int plgfs_fcache_cred_eq(const struct cred *a, const struct cred *b)
+{
+	if (a == b)
+		return 1;
+
+#ifdef CONFIG_SECURITY
+	if (a->security != b->security)
+		return 0;
+#endif
+
+	return uid_eq(a->fsuid, b->fsuid) && gid_eq(a->fsgid, b->fsgid) &&
+		a->group_info == b->group_info && a->user_ns == b->user_ns &&
+		!memcmp(&a->cap_effective, &b->cap_effective,
+				sizeof(kernel_cap_t));
+}
+
+/*
+ * A reused file skips the open checks of the LSM and fanotify on the hidden
+ * fs. Files labeled by an LSM or watched for opens are not kept, and none
+ * when fanotify permission events are possible, their mount marks cannot be
+ * seen from here. A file still referenced elsewhere, e.g. by async I/O of
+ * its previous owner, is not kept either.
+ */
+static int plgfs_fcache_can_keep(struct file *fh)
+{
+	struct dentry *dh;
+
+	if (IS_ENABLED(CONFIG_FANOTIFY_ACCESS_PERMISSIONS))
+		return 0;
+
+#ifdef CONFIG_SECURITY
+	if (fh->f_security)
+		return 0;
+#endif
+
+	dh = fh->f_dentry;
+
+#ifdef CONFIG_FSNOTIFY
+	if (dh->d_inode->i_fsnotify_mask & (FS_OPEN | FS_OPEN_PERM))
+		return 0;
+#endif
+
+	if (dh->d_flags & DCACHE_FSNOTIFY_PARENT_WATCHED)
+		return 0;
+
+	return file_count(fh) == 1;
+}
+
+static void plgfs_fcache_del(struct plgfs_sb_info *sbi,
+		struct plgfs_fcache *fc, struct list_head *free)
+{
+	list_del(&fc->list);
+	list_move_tail(&fc->lru, free);
+	fc->ii->fcache_nr--;
+	sbi->fcache_nr--;
+}
+
+static void plgfs_fcache_free(struct list_head *free)
+{
+	struct plgfs_fcache *fc;
+	struct plgfs_fcache *tmp;
+
+	list_for_each_entry_safe(fc, tmp, free, lru) {
+		list_del(&fc->lru);
+		fput(fc->file);
+		put_cred(fc->cred);
+		kfree(fc);
+	}
+}
+
+struct file *plgfs_fcache_get(struct inode *i, int flags,
+		const struct cred *cred)
+{
+	struct plgfs_sb_info *sbi;
+	struct plgfs_inode_info *ii;
+	struct plgfs_fcache *fc;
+	struct file *fh;
+
+	ii = plgfs_ii(i);
+
+	if (list_empty(&ii->fcache))
+		return NULL;
+
+	sbi = plgfs_sbi(i->i_sb);
+	flags &= ~(O_CREAT | O_EXCL | O_NOCTTY | O_TRUNC);
+	fh = NULL;
+
+	spin_lock(&sbi->fcache_lock);
+
+	list_for_each_entry(fc, &ii->fcache, list) {
+		if (fc->file->f_flags != flags)
+			continue;
+
+		if (!plgfs_fcache_cred_eq(fc->cred, cred))
+			continue;
+
+		list_del(&fc->list);
+		list_del(&fc->lru);
+		ii->fcache_nr--;
+		sbi->fcache_nr--;
+		fh = fc->file;
+		break;
+	}
+
+	spin_unlock(&sbi->fcache_lock);
+
+	if (!fh)
+		return NULL;
+
+	put_cred(fc->cred);
+	kfree(fc);
+
+	fh->f_pos = 0;
+	fh->f_version = 0;
+	file_ra_state_init(&fh->f_ra, fh->f_mapping->host->i_mapping);
+
+	/* mount marks may still want to see the open */
+	fsnotify_open(fh);
+
+	return fh;
+}
+
+int plgfs_fcache_put(struct inode *i, struct file *fh)
+{
+	struct plgfs_sb_info *sbi;
+	struct plgfs_inode_info *ii;
+	struct plgfs_fcache *fc;
+	LIST_HEAD(free);
+
+	if (!S_ISREG(i->i_mode))
+		return 0;
+
+	if ((fh->f_mode & (FMODE_READ | FMODE_WRITE)) != FMODE_READ)
+		return 0;
+
+	if (fh->f_flags & O_DIRECT)
+		return 0;
+
+	if (!i->i_nlink)
+		return 0;
+
+	if (!plgfs_fcache_can_keep(fh))
+		return 0;
+
+	fc = kmalloc(sizeof(struct plgfs_fcache), GFP_KERNEL);
+	if (!fc)
+		return 0;
+
+	ii = plgfs_ii(i);
+	sbi = plgfs_sbi(i->i_sb);
+
+	fc->file = fh;
+	fc->cred = get_cred(fh->f_cred);
+	fc->expire = jiffies + PLGFS_FCACHE_TTL;
+	fc->ii = ii;
+
+	spin_lock(&sbi->fcache_lock);
+
+	if (ii->fcache_nr >= PLGFS_FCACHE_INODE_MAX)
+		plgfs_fcache_del(sbi, list_entry(ii->fcache.prev,
+					struct plgfs_fcache, list), &free);
+
+	list_add(&fc->list, &ii->fcache);
+	list_add_tail(&fc->lru, &sbi->fcache_lru);
+	ii->fcache_nr++;
+	sbi->fcache_nr++;
+
+	spin_unlock(&sbi->fcache_lock);
+
+	plgfs_fcache_free(&free);
+
+	schedule_delayed_work(&sbi->fcache_work, PLGFS_FCACHE_TTL);
+
+	return 1;
+}
+
+void plgfs_fcache_purge(struct inode *i)
+{
+	struct plgfs_sb_info *sbi;
+	struct plgfs_inode_info *ii;
+	struct plgfs_fcache *fc;
+	struct plgfs_fcache *tmp;
+	LIST_HEAD(free);
+
+	ii = plgfs_ii(i);
+
+	if (list_empty(&ii->fcache))
+		return;
+
+	sbi = plgfs_sbi(i->i_sb);
+
+	spin_lock(&sbi->fcache_lock);
+
+	list_for_each_entry_safe(fc, tmp, &ii->fcache, list)
+		plgfs_fcache_del(sbi, fc, &free);
+
+	spin_unlock(&sbi->fcache_lock);
+
+	plgfs_fcache_free(&free);
+}
+
+long plgfs_fcache_shrink(struct plgfs_sb_info *sbi, long nr)
+{
+	struct plgfs_fcache *fc;
+	LIST_HEAD(free);
+	long freed;
+
+	freed = 0;
+
+	spin_lock(&sbi->fcache_lock);
+
+	while (freed < nr && !list_empty(&sbi->fcache_lru)) {
+		fc = list_first_entry(&sbi->fcache_lru, struct plgfs_fcache,
+				lru);
+		plgfs_fcache_del(sbi, fc, &free);
+		freed++;
+	}
+
+	spin_unlock(&sbi->fcache_lock);
+
+	plgfs_fcache_free(&free);
+
+	return freed;
+}
+
+void plgfs_fcache_work(struct work_struct *work)
+{
+	struct plgfs_sb_info *sbi;
+	struct plgfs_fcache *fc;
+	LIST_HEAD(free);
+	int more;
+
+	sbi = container_of(to_delayed_work(work), struct plgfs_sb_info,
+			fcache_work);
+
+	spin_lock(&sbi->fcache_lock);
+
+	while (!list_empty(&sbi->fcache_lru)) {
+		fc = list_first_entry(&sbi->fcache_lru, struct plgfs_fcache,
+				lru);
+		if (time_before(jiffies, fc->expire))
+			break;
+
+		plgfs_fcache_del(sbi, fc, &free);
+	}
+
+	more = !list_empty(&sbi->fcache_lru);
+
+	spin_unlock(&sbi->fcache_lock);
+
+	plgfs_fcache_free(&free);
+
+	if (more)
+		schedule_delayed_work(&sbi->fcache_work, PLGFS_FCACHE_TTL);
+}
@@ -21,6 +21,7 @@
 
 static struct file *plgfs_get_fh(struct file *f)
 {
+	struct file *fh;
 	struct path path;
 	int flags;
 
@@ -36,16 +37,169 @@ static struct file *plgfs_get_fh(struct file *f)
 	else if (f->f_mode == FMODE_WRITE)
 		flags |= O_WRONLY;
 
-	return dentry_open(&path, flags, current_cred());
+	fh = plgfs_fcache_get(f->f_dentry->d_inode, flags, f->f_cred);
+	if (fh)
+		return fh;
+
+	return dentry_open(&path, flags, f->f_cred);
 }
 
-static void plgfs_put_fh(struct file *f)
+/*
+ * The hidden file is opened on the first use, opens followed only by fstat
+ * and close never reach the hidden fs. It is opened with the credentials of
+ * our file, since the first use can come from another task.
+ */
+struct file *plgfs_fh(struct file *f)
 {
+	struct plgfs_file_info *fi;
 	struct file *fh;
 
-	fh = plgfs_fh(f);
+	fi = plgfs_fi(f);
+
+	fh = ACCESS_ONCE(fi->file_hidden);
+	if (fh)
+		return fh;
+
+	fh = plgfs_get_fh(f);
+	if (IS_ERR(fh))
+		return fh;
+
+	if (cmpxchg(&fi->file_hidden, NULL, fh)) {
+		fput(fh);
+		fh = fi->file_hidden;
+	}
+
+	return fh;
+}
+
+/*
+ * With own page cache the data are read and written back through one hidden
+ * file per inode, which lives as long as our inode. It is reopened for
+ * writing when our file is first opened for writing and reopened read-only
+ * again once the last writer is gone and its data are written back, so the
+ * hidden inode is not held open for writing longer than needed.
+ */
+static int plgfs_pc_open_fh(struct file *f)
+{
+	struct plgfs_inode_info *ii;
+	struct inode *i;
+	struct file *fh;
+	struct file *old;
+	struct path path;
+	int writer;
+	int ok;
+
+	i = f->f_dentry->d_inode;
+	ii = plgfs_ii(i);
+
+	writer = f->f_mode & FMODE_WRITE;
+
+	spin_lock(&i->i_lock);
+	fh = ii->file_hidden;
+	ok = fh && (!writer || fh->f_mode & FMODE_WRITE);
+	if (ok && writer)
+		ii->pc_writers++;
+	spin_unlock(&i->i_lock);
+
+	if (ok)
+		return 0;
+
+	path.mnt = plgfs_sbi(i->i_sb)->path_hidden.mnt;
+	path.dentry = plgfs_dh(f->f_dentry);
+
+	fh = dentry_open(&path, (writer ? O_RDWR : O_RDONLY) | O_LARGEFILE,
+			current_cred());
+	if (IS_ERR(fh))
+		return PTR_ERR(fh);
+
+	spin_lock(&i->i_lock);
+	old = ii->file_hidden;
+	if (old && (!writer || old->f_mode & FMODE_WRITE))
+		swap(old, fh);
+	ii->file_hidden = fh;
+	if (writer)
+		ii->pc_writers++;
+	spin_unlock(&i->i_lock);
 
+	if (old)
+		fput(old);
+
+	return 0;
+}
+
+static void plgfs_pc_put_fh(struct file *f)
+{
+	struct plgfs_inode_info *ii;
+	struct inode *i;
+	struct file *fh;
+	struct path path;
+	int last;
+
+	if (!(f->f_mode & FMODE_WRITE))
+		return;
+
+	i = f->f_dentry->d_inode;
+	ii = plgfs_ii(i);
+
+	spin_lock(&i->i_lock);
+	last = !--ii->pc_writers;
+	spin_unlock(&i->i_lock);
+
+	if (!last)
+		return;
+
+	/* dirty pages need the writable file, and mmaps hold our file */
+	if (filemap_write_and_wait(i->i_mapping))
+		return;
+
+	path.mnt = plgfs_sbi(i->i_sb)->path_hidden.mnt;
+	path.dentry = plgfs_dh(f->f_dentry);
+
+	fh = dentry_open(&path, O_RDONLY | O_LARGEFILE, current_cred());
+	if (IS_ERR(fh))
+		return;
+
+	spin_lock(&i->i_lock);
+	if (!ii->pc_writers && !mapping_tagged(i->i_mapping,
+				PAGECACHE_TAG_DIRTY))
+		swap(ii->file_hidden, fh);
+	spin_unlock(&i->i_lock);
+
+	fput(fh);
+}
+
+static struct file *plgfs_pc_get_fh(struct inode *i)
+{
+	struct file *fh;
+
+	spin_lock(&i->i_lock);
+	fh = plgfs_ii(i)->file_hidden;
 	if (fh)
+		get_file(fh);
+	spin_unlock(&i->i_lock);
+
+	return fh;
+}
+
+static void plgfs_put_fh(struct file *f)
+{
+	struct inode *i;
+	struct file *fh;
+
+	i = f->f_dentry->d_inode;
+	fh = plgfs_fi(f)->file_hidden;
+
+	if (S_ISREG(i->i_mode) && plgfs_sbi(i->i_sb)->flags &
+			PLGFS_SBI_PAGECACHE) {
+		/* opened by plgfs_fh for fsync, fallocate or ioctls */
+		if (fh)
+			fput(fh);
+
+		plgfs_pc_put_fh(f);
+		return;
+	}
+
+	if (fh && !plgfs_fcache_put(i, fh))
 		fput(fh);
 }
 
@@ -76,9 +230,28 @@ static int plgfs_fop_open(struct inode *i, struct file *f, int op_id)
 
 	f->private_data = fi;
 
-	fi->file_hidden = plgfs_get_fh(f);
-	if (IS_ERR(fi->file_hidden))
-		cont->op_rv.rv_int = PTR_ERR(fi->file_hidden);
+	if (!S_ISREG(i->i_mode))
+		goto postcalls;
+
+	if (sbi->flags & PLGFS_SBI_PAGECACHE) {
+		cont->op_rv.rv_int = plgfs_pc_open_fh(f);
+		if (cont->op_rv.rv_int) {
+			plgfs_free_fi(sbi, fi);
+			f->private_data = NULL;
+			goto postcalls;
+		}
+	} else if (plgfs_ih(i)->i_sb->s_bdev) {
+		/*
+		 * Data of a regular file are cached only by the hidden inode.
+		 * Point our file at its mapping, so fadvise, readahead and
+		 * sync_file_range, which have no file operations and work on
+		 * f_mapping, act on the page cache that really holds the data.
+		 * Readahead passes our file to the hidden readpages, which
+		 * block device based filesystems ignore, but network ones
+		 * take their private data from, see plgfs_can_alias.
+		 */
+		f->f_mapping = plgfs_ih(i)->i_mapping;
+	}
 
 postcalls:
 	plgfs_postcall_plgs(cont, sbi);
@@ -109,8 +282,8 @@ static int plgfs_fop_release(struct inode *i, struct file *f, int op_id)
 	sbi = plgfs_sbi(i->i_sb);
 	cont = plgfs_alloc_context(sbi);
 	if (IS_ERR(cont)) {
-		fput(plgfs_fh(f));
-		kmem_cache_free(sbi->cache->fi_cache, plgfs_fi(f));
+		plgfs_put_fh(f);
+		plgfs_free_fi(sbi, plgfs_fi(f));
 		pr_err("pluginfs: cannot alloc context for file release, no"
 				"plugins will be called\n");
 		return PTR_ERR(cont);
@@ -122,13 +295,15 @@ static int plgfs_fop_release(struct inode *i, struct file *f, int op_id)
 
 	plgfs_precall_plgs(cont, sbi);
 
+	plgfs_ii_refresh(i);
+
 	plgfs_put_fh(f);
 
 	plgfs_postcall_plgs(cont, sbi);
 
 	rv = cont->op_rv.rv_int;
 
-	kmem_cache_free(sbi->cache->fi_cache, plgfs_fi(f));
+	plgfs_free_fi(sbi, plgfs_fi(f));
 
 	plgfs_free_context(sbi, cont);
 
@@ -145,8 +320,40 @@ static int plgfs_dir_fop_release(struct inode *i, struct file *f)
 	return plgfs_fop_release(i, f, PLGFS_DIR_FOP_RELEASE);
 }
 
+/*
+ * Seeking is done by the hidden file so SEEK_DATA and SEEK_HOLE reach the
+ * hidden fs. Read and write pass the position explicitly and do not use the
+ * hidden f_pos, so SEEK_CUR is resolved against our f_pos here and the
+ * result is copied back to keep both positions the same.
+ */
+static loff_t plgfs_llseek_hidden(struct file *f, loff_t offset, int origin)
+{
+	struct file *fh;
+	loff_t rv;
+
+	fh = plgfs_fh(f);
+	if (IS_ERR(fh))
+		return PTR_ERR(fh);
+
+	if (origin == SEEK_CUR) {
+		offset += f->f_pos;
+		origin = SEEK_SET;
+	}
+
+	rv = vfs_llseek(fh, offset, origin);
+	if (rv < 0)
+		return rv;
+
+	spin_lock(&f->f_lock);
+	f->f_pos = rv;
+	f->f_version = 0;
+	spin_unlock(&f->f_lock);
+
+	return rv;
+}
+
 static loff_t plgfs_fop_llseek(struct file *f, loff_t offset, int origin,
-		int op_id)
+		int op_id, loff_t (*seek)(struct file *, loff_t, int))
 {
 	struct plgfs_context *cont;
 	struct plgfs_sb_info *sbi;
@@ -171,12 +378,12 @@ static loff_t plgfs_fop_llseek(struct file *f, loff_t offset, int origin,
 	offset = cont->op_args.f_llseek.offset;
 	origin = cont->op_args.f_llseek.origin;
 
-	cont->op_rv.rv_loff = generic_file_llseek(f, offset, origin);
+	cont->op_rv.rv_loff = seek(f, offset, origin);
 
 postcalls:
 	plgfs_postcall_plgs(cont, sbi);
 
-	rv = cont->op_rv.rv_int;
+	rv = cont->op_rv.rv_loff;
 
 	plgfs_free_context(sbi, cont);
 
@@ -185,18 +392,155 @@ postcalls:
 
 static loff_t plgfs_reg_fop_llseek(struct file *f, loff_t offset, int origin)
 {
-	return plgfs_fop_llseek(f, offset, origin, PLGFS_REG_FOP_LLSEEK);
+	return plgfs_fop_llseek(f, offset, origin, PLGFS_REG_FOP_LLSEEK,
+			plgfs_llseek_hidden);
 }
 
 static loff_t plgfs_dir_fop_llseek(struct file *f, loff_t offset, int origin)
 {
-	return plgfs_fop_llseek(f, offset, origin, PLGFS_DIR_FOP_LLSEEK);
+	return plgfs_fop_llseek(f, offset, origin, PLGFS_DIR_FOP_LLSEEK,
+			generic_file_llseek);
+}
+
+/*
+ * With readdirplus the entries passed to the caller are also instantiated in
+ * our dcache, so the lookups which usually follow find them there. Only
+ * hidden dentries already in the hidden dcache are used and nothing is read
+ * from the disk. Our dir i_mutex is held by iterate_dir, so no lookup can
+ * add the same name meanwhile.
+ */
+struct plgfs_rdplus {
+	struct dir_context ctx;
+	struct dir_context *ctx_orig;
+	struct dentry *dir;
+	struct dentry *dir_hidden;
+};
+
+static void plgfs_rdplus_add(struct plgfs_rdplus *rdp, const char *name,
+		int len)
+{
+	struct plgfs_dentry_info *di;
+	struct dentry *dh;
+	struct dentry *d;
+	struct inode *i;
+	struct qstr q;
+
+	if (name[0] == '.' && (len == 1 || (len == 2 && name[1] == '.')))
+		return;
+
+	q.name = name;
+	q.len = len;
+	q.hash = full_name_hash(name, len);
+
+	d = d_lookup(rdp->dir, &q);
+	if (d) {
+		dput(d);
+		return;
+	}
+
+	dh = d_lookup(rdp->dir_hidden, &q);
+	if (!dh)
+		return;
+
+	if (!dh->d_inode)
+		goto put_dh;
+
+	di = plgfs_alloc_di(rdp->dir);
+	if (IS_ERR(di))
+		goto put_dh;
+
+	d = d_alloc(rdp->dir, &q);
+	if (!d) {
+		kmem_cache_free(di->cache, di);
+		goto put_dh;
+	}
+
+	di->dentry_hidden = dh;
+	d->d_fsdata = di;
+
+	/* dput of our dentry will also free the hidden one */
+	i = plgfs_iget(d->d_sb, (unsigned long)dh->d_inode);
+	if (IS_ERR(i))
+		goto put_d;
+
+	/* a directory must not get a second alias */
+	if (S_ISDIR(i->i_mode) && !hlist_empty(&i->i_dentry)) {
+		iput(i);
+		goto put_d;
+	}
+
+	d_add(d, i);
+put_d:
+	dput(d);
+	return;
+put_dh:
+	dput(dh);
+}
+
+static int plgfs_rdplus_actor(void *buf, const char *name, int len,
+		loff_t pos, u64 ino, unsigned int type)
+{
+	struct plgfs_rdplus *rdp;
+	int rv;
+
+	rdp = (struct plgfs_rdplus *)buf;
+	rdp->ctx_orig->pos = rdp->ctx.pos;
+
+	rv = rdp->ctx_orig->actor(rdp->ctx_orig, name, len, pos, ino, type);
+	if (rv)
+		return rv;
+
+	plgfs_rdplus_add(rdp, name, len);
+
+	return 0;
+}
+
+/*
+ * Dentries can be added behind the plugins' back only when they do not look
+ * at lookups, and full_name_hash is right only when there is no d_hash.
+ */
+static int plgfs_can_rdplus(struct file *f)
+{
+	struct plgfs_sb_info *sbi;
+
+	sbi = plgfs_sbi(f->f_dentry->d_sb);
+
+	if (!(sbi->flags & PLGFS_SBI_READDIRPLUS))
+		return 0;
+
+	if (plgfs_has_cbs(sbi, PLGFS_DIR_IOP_LOOKUP))
+		return 0;
+
+	return !f->f_dentry->d_sb->s_d_op->d_hash;
+}
+
+static int plgfs_iterate_hidden(struct file *f, struct file *fh,
+		struct dir_context *ctx)
+{
+	struct plgfs_rdplus rdp = {
+		.ctx.actor = plgfs_rdplus_actor,
+		.ctx.pos = ctx->pos,
+		.ctx_orig = ctx,
+		.dir = f->f_dentry,
+		.dir_hidden = fh->f_dentry
+	};
+	int rv;
+
+	if (!plgfs_can_rdplus(f))
+		return iterate_dir(fh, ctx);
+
+	rv = iterate_dir(fh, &rdp.ctx);
+
+	ctx->pos = rdp.ctx.pos;
+
+	return rv;
 }
 
 static int plgfs_dir_fop_iterate(struct file *f, struct dir_context *ctx)
 {
 	struct plgfs_context *cont;
 	struct plgfs_sb_info *sbi;
+	struct file *fh;
 	struct inode *i;
 	int rv;
 
@@ -216,7 +560,13 @@ static int plgfs_dir_fop_iterate(struct file *f, struct dir_context *ctx)
 	f = cont->op_args.f_iterate.file;
 	ctx = cont->op_args.f_iterate.ctx;
 
-	cont->op_rv.rv_int = iterate_dir(plgfs_fh(f), ctx);
+	fh = plgfs_fh(f);
+	if (IS_ERR(fh)) {
+		cont->op_rv.rv_int = PTR_ERR(fh);
+		goto postcalls;
+	}
+
+	cont->op_rv.rv_int = plgfs_iterate_hidden(f, fh, ctx);
 
 postcalls:
 	plgfs_postcall_plgs(cont, sbi);
@@ -228,145 +578,1121 @@ postcalls:
 	return rv;
 }
 
-static ssize_t plgfs_reg_fop_read(struct file *f, char __user *buf, size_t count,
-		loff_t *pos)
+/*
+ * fadvise and readahead(2) set up the readahead state of our file, but it is
+ * the hidden file which reads the data.
+ */
+static void plgfs_sync_ra(struct file *f, struct file *fh)
 {
-	struct plgfs_context *cont;
-	struct plgfs_sb_info *sbi;
-	struct file *fh;
-	struct inode *i;
-	ssize_t rv;
+	fh->f_ra.ra_pages = f->f_ra.ra_pages;
 
-	i = f->f_dentry->d_inode;
-	sbi = plgfs_sbi(i->i_sb);
-	cont = plgfs_alloc_context(sbi);
-	if (IS_ERR(cont))
-		return PTR_ERR(cont);
+	if (!((f->f_mode ^ fh->f_mode) & FMODE_RANDOM))
+		return;
 
-	cont->op_id = PLGFS_REG_FOP_READ;
-	cont->op_args.f_read.file = f;
-	cont->op_args.f_read.buf = buf;
-	cont->op_args.f_read.count = count;
-	cont->op_args.f_read.pos = pos;
+	spin_lock(&fh->f_lock);
+	fh->f_mode = (fh->f_mode & ~FMODE_RANDOM) | (f->f_mode & FMODE_RANDOM);
+	spin_unlock(&fh->f_lock);
+}
 
-	if (!plgfs_precall_plgs(cont, sbi))
-		goto postcalls;
+/*
+ * The hidden file is opened with the f_flags of our file, but O_DIRECT can be
+ * switched later on with fcntl(F_SETFL) and that only reaches our file.
+ */
+static int plgfs_sync_direct(struct file *f, struct file *fh)
+{
+	const struct address_space_operations *aops;
 
-	f = cont->op_args.f_read.file;
-	buf = cont->op_args.f_read.buf;
-	count = cont->op_args.f_read.count;
-	pos = cont->op_args.f_read.pos;
-	i = f->f_dentry->d_inode;
+	if (!((f->f_flags ^ fh->f_flags) & O_DIRECT))
+		return 0;
+
+	aops = fh->f_mapping->a_ops;
+
+	if ((f->f_flags & O_DIRECT) && (!aops || !aops->direct_IO))
+		return -EINVAL;
+
+	spin_lock(&fh->f_lock);
+	fh->f_flags = (fh->f_flags & ~O_DIRECT) | (f->f_flags & O_DIRECT);
+	spin_unlock(&fh->f_lock);
+
+	return 0;
+}
+
+static ssize_t plgfs_direct_rw(struct file *f, int rw, void __user *buf,
+		size_t count, loff_t pos)
+{
+	struct iovec iov = { .iov_base = buf, .iov_len = count };
+	struct kiocb kiocb;
+	struct file *fh;
+	int rv;
 
 	fh = plgfs_fh(f);
+	if (IS_ERR(fh))
+		return PTR_ERR(fh);
 
-	cont->op_rv.rv_ssize = kernel_read(fh,
-			*cont->op_args.f_read.pos,
-			cont->op_args.f_read.buf,
-			cont->op_args.f_read.count);
+	rv = plgfs_sync_direct(f, fh);
+	if (rv)
+		return rv;
 
-	if (cont->op_rv.rv_ssize < 0)
-		goto postcalls;
+	init_sync_kiocb(&kiocb, f);
+	kiocb.ki_pos = pos;
+	kiocb.ki_nbytes = count;
 
-	*pos += cont->op_rv.rv_ssize;
+	return plgfs_reg_aops.direct_IO(rw, &kiocb, &iov, pos, 1);
+}
 
-postcalls:
-	plgfs_postcall_plgs(cont, sbi);
+/*
+ * Transforming plugins work on one kernel bounce buffer, data are copied
+ * between it and the user buffer only once, no matter how many plugins are
+ * stacked. Large requests are processed in chunks of up to PLGFS_XFORM_SIZE,
+ * a single page when higher order pages are not readily available.
+ */
+#define PLGFS_XFORM_SIZE (16 * PAGE_SIZE)
 
-	rv = cont->op_rv.rv_ssize;
+static inline int plgfs_has_xform(struct file *f)
+{
+	struct plgfs_sb_info *sbi;
 
-	plgfs_free_context(sbi, cont);
+	if (!ACCESS_ONCE(plgfs_fi(f)->data_plgs))
+		return 0;
 
-	return rv;
+	sbi = plgfs_sbi(f->f_dentry->d_sb);
+
+	return plgfs_has_cbs(sbi, PLGFS_REG_FOP_READ_XFORM) ||
+		plgfs_has_cbs(sbi, PLGFS_REG_FOP_WRITE_XFORM);
 }
 
-static ssize_t plgfs_reg_fop_write(struct file *f, const char __user *buf, size_t count,
-		loff_t *pos)
+static int plgfs_xform(struct file *f, int op_id, char *buf, size_t count,
+		loff_t pos)
 {
 	struct plgfs_context *cont;
 	struct plgfs_sb_info *sbi;
-	struct file *fh;
-	struct inode *i;
-	ssize_t rv;
+	struct plgfs_file_info *fi;
+	int rv;
 
-	i = f->f_dentry->d_inode;
-	sbi = plgfs_sbi(i->i_sb);
-	cont = plgfs_alloc_context(sbi);
+	fi = plgfs_fi(f);
+	sbi = plgfs_sbi(f->f_dentry->d_sb);
+	cont = plgfs_alloc_fi_context(sbi, fi);
 	if (IS_ERR(cont))
 		return PTR_ERR(cont);
 
-	cont->op_id = PLGFS_REG_FOP_WRITE;
-	cont->op_args.f_write.file = f;
-	cont->op_args.f_write.buf = buf;
-	cont->op_args.f_write.count = count;
-	cont->op_args.f_write.pos = pos;
+	cont->op_id = op_id;
+	cont->op_args.f_xform.file = f;
+	cont->op_args.f_xform.buf = buf;
+	cont->op_args.f_xform.count = count;
+	cont->op_args.f_xform.pos = pos;
+
+	if (op_id == PLGFS_REG_FOP_READ_XFORM)
+		plgfs_precall_plgs(cont, sbi);
+	else {
+		cont->idx_end = sbi->plgs_nr - 1;
+		plgfs_postcall_plgs(cont, sbi);
+	}
 
-	if (!plgfs_precall_plgs(cont, sbi))
-		goto postcalls;
+	rv = cont->op_rv.rv_int;
 
-	f = cont->op_args.f_write.file;
-	buf = cont->op_args.f_write.buf;
-	count = cont->op_args.f_write.count;
-	pos = cont->op_args.f_write.pos;
-	i = f->f_dentry->d_inode;
+	plgfs_free_fi_context(sbi, fi, cont);
 
-	fh = plgfs_fh(f);
+	return rv;
+}
 
-	cont->op_rv.rv_ssize = kernel_write(fh, buf, count, *pos);
+static char *plgfs_xform_alloc(size_t count, int *order)
+{
+	char *kbuf;
 
-	if (cont->op_rv.rv_ssize < 0)
-		goto postcalls;
+	*order = get_order(min_t(size_t, max_t(size_t, count, 1),
+				PLGFS_XFORM_SIZE));
+	if (*order) {
+		kbuf = (char *)__get_free_pages(GFP_KERNEL | __GFP_NOWARN |
+				__GFP_NORETRY, *order);
+		if (kbuf)
+			return kbuf;
 
-	*pos += cont->op_rv.rv_ssize;
+		*order = 0;
+	}
 
-	if (*pos <= i_size_read(i))
-		goto postcalls;
+	return (char *)__get_free_page(GFP_KERNEL);
+}
 
-	i_size_write(i, *pos);
+static ssize_t plgfs_xform_read(struct file *f, struct file *fh,
+		char __user *buf, size_t count, loff_t pos)
+{
+	size_t done;
+	size_t len;
+	ssize_t rv;
+	char *kbuf;
+	int order;
 
-postcalls:
-	plgfs_postcall_plgs(cont, sbi);
+	kbuf = plgfs_xform_alloc(count, &order);
+	if (!kbuf)
+		return -ENOMEM;
 
-	rv = cont->op_rv.rv_ssize;
+	done = 0;
+	rv = 0;
 
-	plgfs_free_context(sbi, cont);
+	while (done < count) {
+		len = min_t(size_t, count - done, PAGE_SIZE << order);
 
-	return rv;
+		rv = kernel_read(fh, pos + done, kbuf, len);
+		if (rv <= 0)
+			break;
+
+		len = rv;
+
+		rv = plgfs_xform(f, PLGFS_REG_FOP_READ_XFORM, kbuf, len,
+				pos + done);
+		if (rv)
+			break;
+
+		if (copy_to_user(buf + done, kbuf, len)) {
+			rv = -EFAULT;
+			break;
+		}
+
+		done += len;
+
+		if (len < PAGE_SIZE << order)
+			break;
+	}
+
+	free_pages((unsigned long)kbuf, order);
+
+	return done ? done : rv;
 }
 
-static int plgfs_reg_fop_fsync(struct file *f, loff_t s, loff_t e, int d)
+static ssize_t plgfs_xform_write_kernel(struct file *f, struct file *fh,
+		char *kbuf, size_t len, loff_t pos)
 {
-	struct plgfs_context *cont;
-	struct plgfs_sb_info *sbi;
-	ssize_t rv;
+	int rv;
 
-	sbi = plgfs_sbi(f->f_dentry->d_inode->i_sb);
-	cont = plgfs_alloc_context(sbi);
-	if (IS_ERR(cont))
-		return PTR_ERR(cont);
+	rv = plgfs_xform(f, PLGFS_REG_FOP_WRITE_XFORM, kbuf, len, pos);
+	if (rv)
+		return rv;
 
-	cont->op_id = PLGFS_REG_FOP_FSYNC;
-	cont->op_args.f_fsync.file = f;
-	cont->op_args.f_fsync.start = s;
+	return kernel_write(fh, kbuf, len, pos);
+}
+
+static ssize_t plgfs_xform_write(struct file *f, struct file *fh,
+		const char __user *buf, size_t count, loff_t pos)
+{
+	size_t done;
+	size_t len;
+	ssize_t rv;
+	char *kbuf;
+	int order;
+
+	kbuf = plgfs_xform_alloc(count, &order);
+	if (!kbuf)
+		return -ENOMEM;
+
+	done = 0;
+	rv = 0;
+
+	while (done < count) {
+		len = min_t(size_t, count - done, PAGE_SIZE << order);
+
+		if (copy_from_user(kbuf, buf + done, len)) {
+			rv = -EFAULT;
+			break;
+		}
+
+		rv = plgfs_xform_write_kernel(f, fh, kbuf, len, pos + done);
+		if (rv <= 0)
+			break;
+
+		done += rv;
+
+		if (rv < len)
+			break;
+	}
+
+	free_pages((unsigned long)kbuf, order);
+
+	return done ? done : rv;
+}
+
+static ssize_t plgfs_xform_iov(struct file *f, struct file *fh,
+		const struct iovec *iov, unsigned long nr_segs, loff_t pos,
+		int rw)
+{
+	unsigned long seg;
+	size_t done;
+	ssize_t rv;
+
+	done = 0;
+	rv = 0;
+
+	for (seg = 0; seg < nr_segs; seg++) {
+		if (rw == WRITE)
+			rv = plgfs_xform_write(f, fh, iov[seg].iov_base,
+					iov[seg].iov_len, pos + done);
+		else
+			rv = plgfs_xform_read(f, fh, iov[seg].iov_base,
+					iov[seg].iov_len, pos + done);
+		if (rv <= 0)
+			break;
+
+		done += rv;
+
+		if (rv < iov[seg].iov_len)
+			break;
+	}
+
+	return done ? done : rv;
+}
+
+/* pipe buffers may be page cache pages, transform a copy */
+static int plgfs_xform_pipe_buf(struct pipe_inode_info *p,
+		struct pipe_buffer *buf, struct splice_desc *sd)
+{
+	struct file *fh;
+	char *kbuf;
+	void *data;
+	int rv;
+
+	fh = plgfs_fh(sd->u.file);
+	if (IS_ERR(fh))
+		return PTR_ERR(fh);
+
+	kbuf = kmalloc(sd->len, GFP_KERNEL);
+	if (!kbuf)
+		return -ENOMEM;
+
+	data = buf->ops->map(p, buf, 0);
+	memcpy(kbuf, data + buf->offset, sd->len);
+	buf->ops->unmap(p, buf, data);
+
+	rv = plgfs_xform_write_kernel(sd->u.file, fh, kbuf, sd->len, sd->pos);
+
+	kfree(kbuf);
+
+	return rv;
+}
+
+static ssize_t plgfs_read_hidden(struct file *f, char __user *buf, size_t count,
+		loff_t *pos)
+{
+	struct file *fh;
+	ssize_t rv;
+
+	fh = plgfs_fh(f);
+	if (IS_ERR(fh))
+		return PTR_ERR(fh);
+
+	plgfs_sync_ra(f, fh);
+
+	if (plgfs_has_xform(f))
+		rv = plgfs_xform_read(f, fh, buf, count, *pos);
+	else if (f->f_flags & O_DIRECT)
+		rv = plgfs_direct_rw(f, READ, buf, count, *pos);
+	else
+		rv = kernel_read(fh, *pos, buf, count);
+
+	if (rv > 0)
+		*pos += rv;
+
+	return rv;
+}
+
+static ssize_t plgfs_write_hidden(struct file *f, const char __user *buf,
+		size_t count, loff_t *pos)
+{
+	struct inode *i;
+	struct file *fh;
+	ssize_t rv;
+
+	i = f->f_dentry->d_inode;
+	fh = plgfs_fh(f);
+	if (IS_ERR(fh))
+		return PTR_ERR(fh);
+
+	if (plgfs_has_xform(f))
+		rv = plgfs_xform_write(f, fh, buf, count, *pos);
+	else if (f->f_flags & O_DIRECT)
+		rv = plgfs_direct_rw(f, WRITE, (void __user *)buf, count,
+				*pos);
+	else
+		rv = kernel_write(fh, buf, count, *pos);
+
+	if (rv < 0)
+		return rv;
+
+	*pos += rv;
+
+	plgfs_dirty_add(i, *pos - rv, *pos);
+	plgfs_ii_set_stale(i);
+
+	return rv;
+}
+
+static ssize_t plgfs_reg_fop_read(struct file *f, char __user *buf, size_t count,
+		loff_t *pos)
+{
+	struct plgfs_context *cont;
+	struct plgfs_sb_info *sbi;
+	struct plgfs_file_info *fi;
+	ssize_t rv;
+
+	fi = plgfs_fi(f);
+
+	/* all plugins are done with the data of this file */
+	if (!ACCESS_ONCE(fi->data_plgs))
+		return plgfs_read_hidden(f, buf, count, pos);
+
+	sbi = plgfs_sbi(f->f_dentry->d_sb);
+	cont = plgfs_alloc_fi_context(sbi, fi);
+	if (IS_ERR(cont))
+		return PTR_ERR(cont);
+
+	cont->op_id = PLGFS_REG_FOP_READ;
+	cont->op_args.f_read.file = f;
+	cont->op_args.f_read.buf = buf;
+	cont->op_args.f_read.count = count;
+	cont->op_args.f_read.pos = pos;
+
+	if (!plgfs_precall_plgs(cont, sbi))
+		goto postcalls;
+
+	f = cont->op_args.f_read.file;
+	buf = cont->op_args.f_read.buf;
+	count = cont->op_args.f_read.count;
+	pos = cont->op_args.f_read.pos;
+
+	cont->op_rv.rv_ssize = plgfs_read_hidden(f, buf, count, pos);
+
+postcalls:
+	plgfs_postcall_plgs(cont, sbi);
+
+	rv = cont->op_rv.rv_ssize;
+
+	plgfs_free_fi_context(sbi, fi, cont);
+
+	return rv;
+}
+
+static ssize_t plgfs_reg_fop_write(struct file *f, const char __user *buf, size_t count,
+		loff_t *pos)
+{
+	struct plgfs_context *cont;
+	struct plgfs_sb_info *sbi;
+	struct plgfs_file_info *fi;
+	ssize_t rv;
+
+	fi = plgfs_fi(f);
+
+	if (!ACCESS_ONCE(fi->data_plgs))
+		return plgfs_write_hidden(f, buf, count, pos);
+
+	sbi = plgfs_sbi(f->f_dentry->d_sb);
+	cont = plgfs_alloc_fi_context(sbi, fi);
+	if (IS_ERR(cont))
+		return PTR_ERR(cont);
+
+	cont->op_id = PLGFS_REG_FOP_WRITE;
+	cont->op_args.f_write.file = f;
+	cont->op_args.f_write.buf = buf;
+	cont->op_args.f_write.count = count;
+	cont->op_args.f_write.pos = pos;
+
+	if (!plgfs_precall_plgs(cont, sbi))
+		goto postcalls;
+
+	f = cont->op_args.f_write.file;
+	buf = cont->op_args.f_write.buf;
+	count = cont->op_args.f_write.count;
+	pos = cont->op_args.f_write.pos;
+
+	cont->op_rv.rv_ssize = plgfs_write_hidden(f, buf, count, pos);
+
+postcalls:
+	plgfs_postcall_plgs(cont, sbi);
+
+	rv = cont->op_rv.rv_ssize;
+
+	plgfs_free_fi_context(sbi, fi, cont);
+
+	return rv;
+}
+
+static ssize_t plgfs_aio_hidden(struct kiocb *iocb, const struct iovec *iov,
+		unsigned long nr_segs, loff_t pos, int rw)
+{
+	ssize_t (*op)(struct kiocb *, const struct iovec *, unsigned long,
+			loff_t);
+	struct file *f;
+	struct file *fh;
+	ssize_t rv;
+
+	f = iocb->ki_filp;
+	fh = plgfs_fh(f);
+	if (IS_ERR(fh))
+		return PTR_ERR(fh);
+
+	/* transforms need the data in our buffer, done synchronously */
+	if (plgfs_has_xform(f)) {
+		rv = plgfs_xform_iov(f, fh, iov, nr_segs, pos, rw);
+		if (rv > 0)
+			iocb->ki_pos = pos + rv;
+
+		return rv;
+	}
+
+	if (!fh->f_op)
+		return -EINVAL;
+
+	op = (rw == WRITE) ? fh->f_op->aio_write : fh->f_op->aio_read;
+	if (!op)
+		return -EINVAL;
+
+	rv = plgfs_sync_direct(f, fh);
+	if (rv)
+		return rv;
+
+	if (rw == READ)
+		plgfs_sync_ra(f, fh);
+
+	if (is_sync_kiocb(iocb)) {
+		iocb->ki_filp = fh;
+
+		if (rw == WRITE)
+			file_start_write(fh);
+
+		rv = op(iocb, iov, nr_segs, pos);
+
+		if (rw == WRITE)
+			file_end_write(fh);
+
+		if (rv == -EIOCBQUEUED)
+			rv = wait_on_sync_kiocb(iocb);
+
+		iocb->ki_filp = f;
+
+		return rv;
+	}
+
+	/*
+	 * An async kiocb is completed by the hidden fs, which also drops the
+	 * reference of the file the kiocb points to. Hand our reference over
+	 * to the hidden file the same way mmap does for vm_file. Callers
+	 * using our file after this hold a reference of their own.
+	 */
+	iocb->ki_filp = get_file(fh);
+	fput(f);
+
+	if (rw == WRITE)
+		file_start_write(fh);
+
+	rv = op(iocb, iov, nr_segs, pos);
+
+	if (rw == WRITE)
+		file_end_write(fh);
+
+	return rv;
+}
+
+static ssize_t plgfs_aio_write_hidden(struct kiocb *iocb,
+		const struct iovec *iov, unsigned long nr_segs, loff_t pos)
+{
+	struct inode *i;
+	struct file *f;
+	size_t len;
+	ssize_t rv;
+
+	/* a queued iocb and its iov may be gone once submitted */
+	f = get_file(iocb->ki_filp);
+	i = f->f_dentry->d_inode;
+	len = iov_length(iov, nr_segs);
+
+	rv = plgfs_aio_hidden(iocb, iov, nr_segs, pos, WRITE);
+
+	/* the whole request for a queued one, we won't see its completion */
+	if (rv == -EIOCBQUEUED) {
+		plgfs_dirty_add(i, pos, pos + len);
+		plgfs_ii_set_stale(i);
+	}
+
+	if (rv > 0) {
+		plgfs_dirty_add(i, pos, pos + rv);
+		plgfs_ii_set_stale(i);
+	}
+
+	fput(f);
+
+	return rv;
+}
+
+/*
+ * Without aio ops the VFS splits readv and writev into READ and WRITE calls
+ * per segment. Plugins hooking those still see them this way for a sync
+ * kiocb, inside the AIO op.
+ */
+static ssize_t plgfs_rw_iov(struct kiocb *iocb, const struct iovec *iov,
+		unsigned long nr_segs, loff_t pos, int rw)
+{
+	unsigned long seg;
+	struct file *f;
+	size_t done;
+	ssize_t rv;
+
+	f = iocb->ki_filp;
+	done = 0;
+	rv = 0;
+
+	for (seg = 0; seg < nr_segs; seg++) {
+		if (rw == WRITE)
+			rv = plgfs_reg_fop_write(f, iov[seg].iov_base,
+					iov[seg].iov_len, &pos);
+		else
+			rv = plgfs_reg_fop_read(f, iov[seg].iov_base,
+					iov[seg].iov_len, &pos);
+		if (rv <= 0)
+			break;
+
+		done += rv;
+
+		if (rv < iov[seg].iov_len)
+			break;
+	}
+
+	if (done)
+		iocb->ki_pos = pos;
+
+	return done ? done : rv;
+}
+
+/*
+ * Post calls are done when the request is submitted. For a request queued by
+ * the hidden fs they see -EIOCBQUEUED, the kiocb has no completion callback
+ * which could be chained. An async kiocb is handed over to the hidden fs,
+ * which may complete and free it before the post calls run, so they get
+ * NULL iocb and iov for it. The reference of the kiocb to our file goes to
+ * the hidden fs too, so our file is held until we are done with its context.
+ */
+static ssize_t plgfs_reg_fop_aio_read(struct kiocb *iocb,
+		const struct iovec *iov, unsigned long nr_segs, loff_t pos)
+{
+	struct plgfs_context *cont;
+	struct plgfs_sb_info *sbi;
+	struct plgfs_file_info *fi;
+	struct file *f;
+	ssize_t rv;
+	int sync;
+
+	fi = plgfs_fi(iocb->ki_filp);
+
+	if (!ACCESS_ONCE(fi->data_plgs))
+		return plgfs_aio_hidden(iocb, iov, nr_segs, pos, READ);
+
+	f = get_file(iocb->ki_filp);
+	sbi = plgfs_sbi(f->f_dentry->d_sb);
+	cont = plgfs_alloc_fi_context(sbi, fi);
+	if (IS_ERR(cont)) {
+		fput(f);
+		return PTR_ERR(cont);
+	}
+
+	cont->op_id = PLGFS_REG_FOP_AIO_READ;
+	cont->op_args.f_aio_read.iocb = iocb;
+	cont->op_args.f_aio_read.iov = iov;
+	cont->op_args.f_aio_read.nr_segs = nr_segs;
+	cont->op_args.f_aio_read.pos = pos;
+
+	if (!plgfs_precall_plgs(cont, sbi))
+		goto postcalls;
+
+	iocb = cont->op_args.f_aio_read.iocb;
+	iov = cont->op_args.f_aio_read.iov;
+	nr_segs = cont->op_args.f_aio_read.nr_segs;
+	pos = cont->op_args.f_aio_read.pos;
+	sync = is_sync_kiocb(iocb);
+
+	if (sync && plgfs_has_cbs(sbi, PLGFS_REG_FOP_READ))
+		cont->op_rv.rv_ssize = plgfs_rw_iov(iocb, iov, nr_segs, pos,
+				READ);
+	else
+		cont->op_rv.rv_ssize = plgfs_aio_hidden(iocb, iov, nr_segs,
+				pos, READ);
+
+	/* an async iocb belongs to the hidden fs now, see pluginfs.h */
+	if (!sync) {
+		cont->op_args.f_aio_read.iocb = NULL;
+		cont->op_args.f_aio_read.iov = NULL;
+	}
+
+postcalls:
+	plgfs_postcall_plgs(cont, sbi);
+
+	rv = cont->op_rv.rv_ssize;
+
+	plgfs_free_fi_context(sbi, fi, cont);
+
+	fput(f);
+
+	return rv;
+}
+
+static ssize_t plgfs_reg_fop_aio_write(struct kiocb *iocb,
+		const struct iovec *iov, unsigned long nr_segs, loff_t pos)
+{
+	struct plgfs_context *cont;
+	struct plgfs_sb_info *sbi;
+	struct plgfs_file_info *fi;
+	struct file *f;
+	ssize_t rv;
+	int sync;
+
+	fi = plgfs_fi(iocb->ki_filp);
+
+	if (!ACCESS_ONCE(fi->data_plgs))
+		return plgfs_aio_write_hidden(iocb, iov, nr_segs, pos);
+
+	f = get_file(iocb->ki_filp);
+	sbi = plgfs_sbi(f->f_dentry->d_sb);
+	cont = plgfs_alloc_fi_context(sbi, fi);
+	if (IS_ERR(cont)) {
+		fput(f);
+		return PTR_ERR(cont);
+	}
+
+	cont->op_id = PLGFS_REG_FOP_AIO_WRITE;
+	cont->op_args.f_aio_write.iocb = iocb;
+	cont->op_args.f_aio_write.iov = iov;
+	cont->op_args.f_aio_write.nr_segs = nr_segs;
+	cont->op_args.f_aio_write.pos = pos;
+
+	if (!plgfs_precall_plgs(cont, sbi))
+		goto postcalls;
+
+	iocb = cont->op_args.f_aio_write.iocb;
+	iov = cont->op_args.f_aio_write.iov;
+	nr_segs = cont->op_args.f_aio_write.nr_segs;
+	pos = cont->op_args.f_aio_write.pos;
+	sync = is_sync_kiocb(iocb);
+
+	if (sync && plgfs_has_cbs(sbi, PLGFS_REG_FOP_WRITE))
+		cont->op_rv.rv_ssize = plgfs_rw_iov(iocb, iov, nr_segs, pos,
+				WRITE);
+	else
+		cont->op_rv.rv_ssize = plgfs_aio_write_hidden(iocb, iov,
+				nr_segs, pos);
+
+	if (!sync) {
+		cont->op_args.f_aio_write.iocb = NULL;
+		cont->op_args.f_aio_write.iov = NULL;
+	}
+
+postcalls:
+	plgfs_postcall_plgs(cont, sbi);
+
+	rv = cont->op_rv.rv_ssize;
+
+	plgfs_free_fi_context(sbi, fi, cont);
+
+	fput(f);
+
+	return rv;
+}
+
+/*
+ * What default_file_splice_write does for filesystems without splice_write,
+ * it is not exported.
+ */
+static int plgfs_pipe_buf_hidden(struct pipe_inode_info *p,
+		struct pipe_buffer *buf, struct splice_desc *sd)
+{
+	void *data;
+	int rv;
+
+	data = buf->ops->map(p, buf, 0);
+	rv = kernel_write(sd->u.file, data + buf->offset, sd->len, sd->pos);
+	buf->ops->unmap(p, buf, data);
+
+	return rv;
+}
+
+static ssize_t plgfs_reg_fop_splice_read(struct file *f, loff_t *pos,
+		struct pipe_inode_info *p, size_t len, unsigned int flags)
+{
+	struct plgfs_context *cont;
+	struct plgfs_sb_info *sbi;
+	struct plgfs_file_info *fi;
+	struct file *fh;
+	ssize_t rv;
+
+	fi = plgfs_fi(f);
+	sbi = plgfs_sbi(f->f_dentry->d_inode->i_sb);
+	cont = plgfs_alloc_fi_context(sbi, fi);
+	if (IS_ERR(cont))
+		return PTR_ERR(cont);
+
+	cont->op_id = PLGFS_REG_FOP_SPLICE_READ;
+	cont->op_args.f_splice_read.file = f;
+	cont->op_args.f_splice_read.pos = pos;
+	cont->op_args.f_splice_read.pipe = p;
+	cont->op_args.f_splice_read.len = len;
+	cont->op_args.f_splice_read.flags = flags;
+
+	if (!plgfs_precall_plgs(cont, sbi))
+		goto postcalls;
+
+	f = cont->op_args.f_splice_read.file;
+	pos = cont->op_args.f_splice_read.pos;
+	p = cont->op_args.f_splice_read.pipe;
+	len = cont->op_args.f_splice_read.len;
+	flags = cont->op_args.f_splice_read.flags;
+
+	fh = plgfs_fh(f);
+	if (IS_ERR(fh)) {
+		cont->op_rv.rv_ssize = PTR_ERR(fh);
+		goto postcalls;
+	}
+
+	/* hidden pages can't go to the pipe as they are, read them through us */
+	if (plgfs_has_xform(f)) {
+		cont->op_rv.rv_ssize = default_file_splice_read(f, pos, p, len,
+				flags);
+		goto postcalls;
+	}
+
+	plgfs_sync_ra(f, fh);
+
+	/* pages are moved straight from the hidden page cache to the pipe */
+	if (fh->f_op && fh->f_op->splice_read)
+		cont->op_rv.rv_ssize = fh->f_op->splice_read(fh, pos, p, len,
+				flags);
+	else
+		cont->op_rv.rv_ssize = default_file_splice_read(fh, pos, p,
+				len, flags);
+
+postcalls:
+	plgfs_postcall_plgs(cont, sbi);
+
+	rv = cont->op_rv.rv_ssize;
+
+	plgfs_free_fi_context(sbi, fi, cont);
+
+	return rv;
+}
+
+static ssize_t plgfs_reg_fop_splice_write(struct pipe_inode_info *p,
+		struct file *f, loff_t *pos, size_t len, unsigned int flags)
+{
+	struct plgfs_context *cont;
+	struct plgfs_sb_info *sbi;
+	struct plgfs_file_info *fi;
+	struct file *fh;
+	struct inode *i;
+	ssize_t rv;
+
+	fi = plgfs_fi(f);
+	i = f->f_dentry->d_inode;
+	sbi = plgfs_sbi(i->i_sb);
+	cont = plgfs_alloc_fi_context(sbi, fi);
+	if (IS_ERR(cont))
+		return PTR_ERR(cont);
+
+	cont->op_id = PLGFS_REG_FOP_SPLICE_WRITE;
+	cont->op_args.f_splice_write.pipe = p;
+	cont->op_args.f_splice_write.file = f;
+	cont->op_args.f_splice_write.pos = pos;
+	cont->op_args.f_splice_write.len = len;
+	cont->op_args.f_splice_write.flags = flags;
+
+	if (!plgfs_precall_plgs(cont, sbi))
+		goto postcalls;
+
+	p = cont->op_args.f_splice_write.pipe;
+	f = cont->op_args.f_splice_write.file;
+	pos = cont->op_args.f_splice_write.pos;
+	len = cont->op_args.f_splice_write.len;
+	flags = cont->op_args.f_splice_write.flags;
+	i = f->f_dentry->d_inode;
+
+	fh = plgfs_fh(f);
+	if (IS_ERR(fh)) {
+		cont->op_rv.rv_ssize = PTR_ERR(fh);
+		goto postcalls;
+	}
+
+	if (plgfs_has_xform(f)) {
+		cont->op_rv.rv_ssize = splice_from_pipe(p, f, pos, len, flags,
+				plgfs_xform_pipe_buf);
+		if (cont->op_rv.rv_ssize > 0)
+			*pos += cont->op_rv.rv_ssize;
+	} else if (fh->f_op && fh->f_op->splice_write) {
+		/*
+		 * The VFS took freeze protection only for our sb, kernel_write
+		 * in the actors takes it for the hidden one by itself.
+		 */
+		file_start_write(fh);
+		cont->op_rv.rv_ssize = fh->f_op->splice_write(p, fh, pos, len,
+				flags);
+		file_end_write(fh);
+	} else {
+		/* splice_from_pipe leaves the position to its caller */
+		cont->op_rv.rv_ssize = splice_from_pipe(p, fh, pos, len, flags,
+				plgfs_pipe_buf_hidden);
+		if (cont->op_rv.rv_ssize > 0)
+			*pos += cont->op_rv.rv_ssize;
+	}
+
+	if (cont->op_rv.rv_ssize <= 0)
+		goto postcalls;
+
+	plgfs_dirty_add(i, *pos - cont->op_rv.rv_ssize, *pos);
+	plgfs_ii_set_stale(i);
+
+postcalls:
+	plgfs_postcall_plgs(cont, sbi);
+
+	rv = cont->op_rv.rv_ssize;
+
+	plgfs_free_fi_context(sbi, fi, cont);
+
+	return rv;
+}
+
+static long plgfs_reg_fop_fallocate(struct file *f, int mode, loff_t offset,
+		loff_t len)
+{
+	struct plgfs_context *cont;
+	struct plgfs_sb_info *sbi;
+	struct file *fh;
+	struct inode *i;
+	long rv;
+	int pc;
+
+	i = f->f_dentry->d_inode;
+	sbi = plgfs_sbi(i->i_sb);
+	cont = plgfs_alloc_context(sbi);
+	if (IS_ERR(cont))
+		return PTR_ERR(cont);
+
+	cont->op_id = PLGFS_REG_FOP_FALLOCATE;
+	cont->op_args.f_fallocate.file = f;
+	cont->op_args.f_fallocate.mode = mode;
+	cont->op_args.f_fallocate.offset = offset;
+	cont->op_args.f_fallocate.len = len;
+
+	if (!plgfs_precall_plgs(cont, sbi))
+		goto postcalls;
+
+	f = cont->op_args.f_fallocate.file;
+	mode = cont->op_args.f_fallocate.mode;
+	offset = cont->op_args.f_fallocate.offset;
+	len = cont->op_args.f_fallocate.len;
+	i = f->f_dentry->d_inode;
+
+	fh = plgfs_fh(f);
+	if (IS_ERR(fh)) {
+		cont->op_rv.rv_long = PTR_ERR(fh);
+		goto postcalls;
+	}
+
+	cont->op_rv.rv_long = -EOPNOTSUPP;
+
+	if (!fh->f_op || !fh->f_op->fallocate)
+		goto postcalls;
+
+	pc = sbi->flags & PLGFS_SBI_PAGECACHE;
+
+	/* own dirty pages in a hole would be written over it later */
+	if (pc && (mode & FALLOC_FL_PUNCH_HOLE)) {
+		cont->op_rv.rv_long = filemap_write_and_wait_range(
+				i->i_mapping, offset, offset + len - 1);
+		if (cont->op_rv.rv_long)
+			goto postcalls;
+	}
+
+	file_start_write(fh);
+	cont->op_rv.rv_long = fh->f_op->fallocate(fh, mode, offset, len);
+	file_end_write(fh);
+
+	if (cont->op_rv.rv_long)
+		goto postcalls;
+
+	if (mode & FALLOC_FL_PUNCH_HOLE)
+		plgfs_dirty_add(i, offset, offset + len);
+
+	fsstack_copy_attr_times(i, fh->f_dentry->d_inode);
+
+	if (!pc) {
+		fsstack_copy_inode_size(i, fh->f_dentry->d_inode);
+		goto postcalls;
+	}
+
+	if (mode & FALLOC_FL_PUNCH_HOLE)
+		truncate_pagecache_range(i, offset, offset + len - 1);
+
+	/* own size may be ahead of the hidden one until writeback */
+	mutex_lock(&i->i_mutex);
+	if (i_size_read(fh->f_dentry->d_inode) > i_size_read(i))
+		i_size_write(i, i_size_read(fh->f_dentry->d_inode));
+	mutex_unlock(&i->i_mutex);
+
+postcalls:
+	plgfs_postcall_plgs(cont, sbi);
+
+	rv = cont->op_rv.rv_long;
+
+	plgfs_free_context(sbi, cont);
+
+	return rv;
+}
+
+static int plgfs_reg_fop_fsync(struct file *f, loff_t s, loff_t e, int d)
+{
+	struct plgfs_context *cont;
+	struct plgfs_sb_info *sbi;
+	struct file *fh;
+	ssize_t rv;
+
+	sbi = plgfs_sbi(f->f_dentry->d_inode->i_sb);
+	cont = plgfs_alloc_context(sbi);
+	if (IS_ERR(cont))
+		return PTR_ERR(cont);
+
+	cont->op_id = PLGFS_REG_FOP_FSYNC;
+	cont->op_args.f_fsync.file = f;
+	cont->op_args.f_fsync.start = s;
 	cont->op_args.f_fsync.end = e;
 	cont->op_args.f_fsync.datasync = d;
 
-	if (!plgfs_precall_plgs(cont, sbi))
-		goto postcalls;
+	if (!plgfs_precall_plgs(cont, sbi))
+		goto postcalls;
+
+	f = cont->op_args.f_fsync.file;
+	s = cont->op_args.f_fsync.start;
+	e = cont->op_args.f_fsync.end;
+	d = cont->op_args.f_fsync.datasync;
+
+	if (plgfs_sbi(f->f_dentry->d_sb)->flags & PLGFS_SBI_PAGECACHE) {
+		cont->op_rv.rv_int = filemap_write_and_wait_range(f->f_mapping,
+				s, e);
+		if (cont->op_rv.rv_int)
+			goto postcalls;
+	}
+
+	fh = plgfs_fh(f);
+	if (IS_ERR(fh)) {
+		cont->op_rv.rv_int = PTR_ERR(fh);
+		goto postcalls;
+	}
+
+	cont->op_rv.rv_int = vfs_fsync(fh, d);
+
+	plgfs_ii_refresh(f->f_dentry->d_inode);
+
+postcalls:
+	plgfs_postcall_plgs(cont, sbi);
+
+	rv = cont->op_rv.rv_ssize;
+
+	plgfs_free_context(sbi, cont);
+
+	return rv;
+}
+
+static void plgfs_vm_open(struct vm_area_struct *v)
+{
+	struct plgfs_vm_ops *vo;
+
+	vo = container_of(v->vm_ops, struct plgfs_vm_ops, ops);
+
+	ihold(vo->inode);
+
+	if (vo->ops_hidden->open)
+		vo->ops_hidden->open(v);
+}
+
+static void plgfs_vm_close(struct vm_area_struct *v)
+{
+	struct plgfs_vm_ops *vo;
+
+	vo = container_of(v->vm_ops, struct plgfs_vm_ops, ops);
+
+	if (vo->ops_hidden->close)
+		vo->ops_hidden->close(v);
+
+	/* may free vo */
+	iput(vo->inode);
+}
+
+static int plgfs_vm_page_mkwrite(struct vm_area_struct *v, struct vm_fault *vmf)
+{
+	struct plgfs_vm_ops *vo;
+	loff_t start;
+	int rv;
+
+	vo = container_of(v->vm_ops, struct plgfs_vm_ops, ops);
+
+	rv = 0;
+	if (vo->ops_hidden->page_mkwrite)
+		rv = vo->ops_hidden->page_mkwrite(v, vmf);
+
+	if (rv & (VM_FAULT_ERROR | VM_FAULT_NOPAGE | VM_FAULT_RETRY))
+		return rv;
+
+	start = (loff_t)vmf->pgoff << PAGE_CACHE_SHIFT;
+	plgfs_dirty_add(vo->inode, start, start + PAGE_CACHE_SIZE);
+
+	return rv;
+}
+
+/*
+ * Writes through a shared mapping go straight to the hidden page cache. To
+ * see them the vm_ops of the hidden file are wrapped, once per inode, and
+ * each page made writable is recorded. The vma keeps a reference of our
+ * inode, since it is the only one pointing to the wrapper.
+ */
+static void plgfs_vm_track(struct inode *i, struct vm_area_struct *v)
+{
+	struct plgfs_inode_info *ii;
+	struct plgfs_vm_ops *vo;
 
-	f = cont->op_args.f_fsync.file;
-	d = cont->op_args.f_fsync.datasync;
+	if (!(plgfs_sbi(i->i_sb)->flags & PLGFS_SBI_TRACK_DIRTY))
+		return;
 
-	cont->op_rv.rv_int = vfs_fsync(plgfs_fh(f), d);
+	if (!(v->vm_flags & VM_SHARED) || !(v->vm_flags & VM_MAYWRITE))
+		return;
 
-postcalls:
-	plgfs_postcall_plgs(cont, sbi);
+	ii = plgfs_ii(i);
 
-	rv = cont->op_rv.rv_ssize;
+	if (!v->vm_ops) {
+		plgfs_dirty_lost(i);
+		return;
+	}
 
-	plgfs_free_context(sbi, cont);
+	if (!ii->vm_ops) {
+		vo = kzalloc(sizeof(struct plgfs_vm_ops), GFP_KERNEL);
+		if (!vo) {
+			plgfs_dirty_lost(i);
+			return;
+		}
+
+		vo->ops = *v->vm_ops;
+		vo->ops.open = plgfs_vm_open;
+		vo->ops.close = plgfs_vm_close;
+		vo->ops.page_mkwrite = plgfs_vm_page_mkwrite;
+		vo->ops_hidden = v->vm_ops;
+		vo->inode = i;
+
+		spin_lock(&ii->dirty_lock);
+		if (!ii->vm_ops) {
+			ii->vm_ops = vo;
+			vo = NULL;
+		}
+		spin_unlock(&ii->dirty_lock);
+
+		kfree(vo);
+	}
 
-	return rv;
+	if (ii->vm_ops->ops_hidden != v->vm_ops) {
+		plgfs_dirty_lost(i);
+		return;
+	}
+
+	ihold(i);
+	v->vm_ops = &ii->vm_ops->ops;
 }
 
 static int plgfs_reg_fop_mmap(struct file *f, struct vm_area_struct *v)
@@ -390,7 +1716,12 @@ static int plgfs_reg_fop_mmap(struct file *f, struct vm_area_struct *v)
 
 	f = cont->op_args.f_mmap.file;
 	v = cont->op_args.f_mmap.vma;
+
 	fh = plgfs_fh(f);
+	if (IS_ERR(fh)) {
+		cont->op_rv.rv_int = PTR_ERR(fh);
+		goto postcalls;
+	}
 
 	cont->op_rv.rv_int = -ENODEV;
 	if (!fh->f_op->mmap)
@@ -401,8 +1732,11 @@ static int plgfs_reg_fop_mmap(struct file *f, struct vm_area_struct *v)
 	if (cont->op_rv.rv_int) {
 		fput(fh);
 		v->vm_file = f;
-	} else
-		fput(f);
+		goto postcalls;
+	}
+
+	plgfs_vm_track(f->f_dentry->d_inode, v);
+	fput(f);
 
 postcalls:
 	plgfs_postcall_plgs(cont, sbi);
@@ -441,6 +1775,10 @@ static long plgfs_fop_compat_ioctl(struct file *f, unsigned int cmd,
 	arg = cont->op_args.f_compat_ioctl.arg;
 
 	fh = plgfs_fh(f);
+	if (IS_ERR(fh)) {
+		cont->op_rv.rv_long = PTR_ERR(fh);
+		goto postcalls;
+	}
 
 	cont->op_rv.rv_long = -ENOIOCTLCMD;
 
@@ -498,6 +1836,10 @@ static long plgfs_fop_unlocked_ioctl(struct file *f, unsigned int cmd,
 	arg = cont->op_args.f_unlocked_ioctl.arg;
 
 	fh = plgfs_fh(f);
+	if (IS_ERR(fh)) {
+		cont->op_rv.rv_long = PTR_ERR(fh);
+		goto postcalls;
+	}
 
 	cont->op_rv.rv_long = -ENOTTY;
 
@@ -552,11 +1894,14 @@ static int plgfs_fop_flush(struct file *f, fl_owner_t id, int op_id)
 	f = cont->op_args.f_flush.file;
 	id = cont->op_args.f_flush.id;
 
-	fh = plgfs_fh(f);
+	/* nothing to flush in a hidden file never opened */
+	fh = plgfs_fi(f)->file_hidden;
+
+	plgfs_ii_refresh(f->f_dentry->d_inode);
 
 	cont->op_rv.rv_int = 0;
 
-	if (!fh->f_op || !fh->f_op->flush)
+	if (!fh || !fh->f_op || !fh->f_op->flush)
 		goto postcalls;
 
 	cont->op_rv.rv_int = fh->f_op->flush(fh, id);
@@ -586,6 +1931,52 @@ const struct file_operations plgfs_reg_fops = {
 	.release = plgfs_reg_fop_release,
 	.read = plgfs_reg_fop_read,
 	.write = plgfs_reg_fop_write,
+	.aio_read = plgfs_reg_fop_aio_read,
+	.aio_write = plgfs_reg_fop_aio_write,
+	.llseek = plgfs_reg_fop_llseek,
+	.fsync = plgfs_reg_fop_fsync,
+	.mmap = plgfs_reg_fop_mmap,
+#ifdef CONFIG_COMPAT
+	.compat_ioctl = plgfs_reg_fop_compat_ioctl,
+#endif
+	.unlocked_ioctl = plgfs_reg_fop_unlocked_ioctl,
+	.flush = plgfs_reg_fop_flush,
+	.splice_read = plgfs_reg_fop_splice_read,
+	.splice_write = plgfs_reg_fop_splice_write,
+	.fallocate = plgfs_reg_fop_fallocate
+};
+
+/*
+ * Our file already points to the hidden mapping, so buffered reads are served
+ * from the hidden page cache without going through the hidden file. Direct
+ * I/O is left to the hidden file.
+ */
+static ssize_t plgfs_reg_alias_fop_aio_read(struct kiocb *iocb,
+		const struct iovec *iov, unsigned long nr_segs, loff_t pos)
+{
+	struct path path;
+	ssize_t rv;
+
+	if (iocb->ki_filp->f_flags & O_DIRECT)
+		return plgfs_reg_fop_aio_read(iocb, iov, nr_segs, pos);
+
+	path.mnt = plgfs_sbi(iocb->ki_filp->f_dentry->d_sb)->path_hidden.mnt;
+	path.dentry = plgfs_dh(iocb->ki_filp->f_dentry);
+
+	rv = generic_file_aio_read(iocb, iov, nr_segs, pos);
+	if (rv >= 0 && !(iocb->ki_filp->f_flags & O_NOATIME))
+		touch_atime(&path);
+
+	return rv;
+}
+
+const struct file_operations plgfs_reg_alias_fops = {
+	.open = plgfs_reg_fop_open,
+	.release = plgfs_reg_fop_release,
+	.read = do_sync_read,
+	.write = plgfs_reg_fop_write,
+	.aio_read = plgfs_reg_alias_fop_aio_read,
+	.aio_write = plgfs_reg_fop_aio_write,
 	.llseek = plgfs_reg_fop_llseek,
 	.fsync = plgfs_reg_fop_fsync,
 	.mmap = plgfs_reg_fop_mmap,
@@ -593,7 +1984,10 @@ const struct file_operations plgfs_reg_fops = {
 	.compat_ioctl = plgfs_reg_fop_compat_ioctl,
 #endif
 	.unlocked_ioctl = plgfs_reg_fop_unlocked_ioctl,
-	.flush = plgfs_reg_fop_flush
+	.flush = plgfs_reg_fop_flush,
+	.splice_read = generic_file_splice_read,
+	.splice_write = plgfs_reg_fop_splice_write,
+	.fallocate = plgfs_reg_fop_fallocate
 };
 
 const struct file_operations plgfs_dir_fops = {
@@ -608,6 +2002,410 @@ const struct file_operations plgfs_dir_fops = {
 	.flush = plgfs_dir_fop_flush
 };
 
+static ssize_t plgfs_direct_hidden(struct file *fh, int rw,
+		const struct iovec *iov, unsigned long nr_segs, loff_t pos)
+{
+	struct kiocb kiocb;
+	ssize_t rv;
+
+	if (!fh->f_op)
+		return -EINVAL;
+
+	init_sync_kiocb(&kiocb, fh);
+	kiocb.ki_pos = pos;
+	kiocb.ki_nbytes = iov_length(iov, nr_segs);
+
+	if (rw == WRITE) {
+		if (!fh->f_op->aio_write)
+			return -EINVAL;
+
+		file_start_write(fh);
+		rv = fh->f_op->aio_write(&kiocb, iov, nr_segs, pos);
+		file_end_write(fh);
+	} else {
+		if (!fh->f_op->aio_read)
+			return -EINVAL;
+
+		rv = fh->f_op->aio_read(&kiocb, iov, nr_segs, pos);
+	}
+
+	if (rv == -EIOCBQUEUED)
+		rv = wait_on_sync_kiocb(&kiocb);
+
+	return rv;
+}
+
+/*
+ * Our mapping never holds any data, direct I/O requests are handed over to
+ * the hidden file, which was opened with O_DIRECT and does the real work.
+ */
+static ssize_t plgfs_reg_aop_direct_IO(int rw, struct kiocb *iocb,
+		const struct iovec *iov, loff_t offset, unsigned long nr_segs)
+{
+	struct plgfs_context *cont;
+	struct plgfs_sb_info *sbi;
+	struct plgfs_file_info *fi;
+	struct file *fh;
+	struct file *f;
+	ssize_t rv;
+
+	f = iocb->ki_filp;
+	fi = plgfs_fi(f);
+	sbi = plgfs_sbi(f->f_dentry->d_inode->i_sb);
+	cont = plgfs_alloc_fi_context(sbi, fi);
+	if (IS_ERR(cont))
+		return PTR_ERR(cont);
+
+	cont->op_id = PLGFS_REG_AOP_DIRECT_IO;
+	cont->op_args.a_direct_io.rw = rw;
+	cont->op_args.a_direct_io.iocb = iocb;
+	cont->op_args.a_direct_io.iov = iov;
+	cont->op_args.a_direct_io.offset = offset;
+	cont->op_args.a_direct_io.nr_segs = nr_segs;
+
+	if (!plgfs_precall_plgs(cont, sbi))
+		goto postcalls;
+
+	rw = cont->op_args.a_direct_io.rw;
+	iocb = cont->op_args.a_direct_io.iocb;
+	iov = cont->op_args.a_direct_io.iov;
+	offset = cont->op_args.a_direct_io.offset;
+	nr_segs = cont->op_args.a_direct_io.nr_segs;
+
+	fh = plgfs_fh(iocb->ki_filp);
+	if (IS_ERR(fh)) {
+		cont->op_rv.rv_ssize = PTR_ERR(fh);
+		goto postcalls;
+	}
+
+	cont->op_rv.rv_ssize = plgfs_direct_hidden(fh, rw, iov, nr_segs,
+			offset);
+
+postcalls:
+	plgfs_postcall_plgs(cont, sbi);
+
+	rv = cont->op_rv.rv_ssize;
+
+	plgfs_free_fi_context(sbi, fi, cont);
+
+	return rv;
+}
+
+const struct address_space_operations plgfs_reg_aops = {
+	.direct_IO = plgfs_reg_aop_direct_IO
+};
+
+/*
+ * Page cache mode. Our mapping holds the data as seen by the user, after the
+ * plugins transformed them in READPAGE post calls, and read, write and mmap
+ * are all served from it. Pages are filled from and written back to the
+ * hidden file, WRITEPAGE pre calls transform a copy of the page, so the page
+ * itself stays untouched and unlocked while it is being written.
+ */
+static int plgfs_pc_readpage(struct file *f, struct page *page)
+{
+	struct plgfs_context *cont;
+	struct plgfs_sb_info *sbi;
+	struct inode *i;
+	struct file *fh;
+	char *addr;
+	int rv;
+
+	i = page->mapping->host;
+	sbi = plgfs_sbi(i->i_sb);
+	cont = plgfs_alloc_context(sbi);
+	if (IS_ERR(cont))
+		return PTR_ERR(cont);
+
+	cont->op_id = PLGFS_REG_AOP_READPAGE;
+	cont->op_args.a_readpage.file = f;
+	cont->op_args.a_readpage.page = page;
+
+	if (!plgfs_precall_plgs(cont, sbi))
+		goto postcalls;
+
+	page = cont->op_args.a_readpage.page;
+
+	cont->op_rv.rv_int = -EIO;
+
+	fh = plgfs_pc_get_fh(i);
+	if (!fh)
+		goto postcalls;
+
+	addr = kmap(page);
+	rv = kernel_read(fh, page_offset(page), addr, PAGE_CACHE_SIZE);
+	if (rv >= 0)
+		memset(addr + rv, 0, PAGE_CACHE_SIZE - rv);
+	kunmap(page);
+	flush_dcache_page(page);
+
+	fput(fh);
+
+	cont->op_rv.rv_int = rv < 0 ? rv : 0;
+
+postcalls:
+	plgfs_postcall_plgs(cont, sbi);
+
+	rv = cont->op_rv.rv_int;
+
+	plgfs_free_context(sbi, cont);
+
+	if (!rv)
+		SetPageUptodate(page);
+	else
+		SetPageError(page);
+
+	return rv;
+}
+
+static int plgfs_reg_pc_aop_readpage(struct file *f, struct page *page)
+{
+	int rv;
+
+	rv = plgfs_pc_readpage(f, page);
+
+	unlock_page(page);
+
+	return rv;
+}
+
+static int plgfs_reg_pc_aop_writepage(struct page *page,
+		struct writeback_control *wbc)
+{
+	struct plgfs_context *cont;
+	struct plgfs_sb_info *sbi;
+	struct page *bounce;
+	struct page *data;
+	struct inode *i;
+	struct file *fh;
+	loff_t size;
+	size_t len;
+	char *addr;
+	int rv;
+
+	i = page->mapping->host;
+	sbi = plgfs_sbi(i->i_sb);
+
+	bounce = alloc_page(GFP_NOFS);
+	if (!bounce)
+		goto redirty;
+
+	cont = plgfs_alloc_context_atomic(sbi);
+	if (IS_ERR(cont)) {
+		__free_page(bounce);
+		goto redirty;
+	}
+
+	copy_highpage(bounce, page);
+	set_page_writeback(page);
+	unlock_page(page);
+
+	cont->op_id = PLGFS_REG_AOP_WRITEPAGE;
+	cont->op_args.a_writepage.page = page;
+	cont->op_args.a_writepage.data = bounce;
+	cont->op_args.a_writepage.wbc = wbc;
+
+	if (!plgfs_precall_plgs(cont, sbi))
+		goto postcalls;
+
+	data = cont->op_args.a_writepage.data;
+
+	cont->op_rv.rv_int = 0;
+
+	/* truncated meanwhile */
+	size = i_size_read(i);
+	if (page_offset(page) >= size)
+		goto postcalls;
+
+	len = min_t(loff_t, PAGE_CACHE_SIZE, size - page_offset(page));
+
+	cont->op_rv.rv_int = -EIO;
+
+	fh = plgfs_pc_get_fh(i);
+	if (!fh)
+		goto postcalls;
+
+	addr = kmap(data);
+	rv = kernel_write(fh, addr, len, page_offset(page));
+	kunmap(data);
+
+	fput(fh);
+
+	if (rv < 0)
+		cont->op_rv.rv_int = rv;
+	else if (rv == len)
+		cont->op_rv.rv_int = 0;
+
+postcalls:
+	plgfs_postcall_plgs(cont, sbi);
+
+	rv = cont->op_rv.rv_int;
+
+	plgfs_free_context(sbi, cont);
+	__free_page(bounce);
+
+	if (rv) {
+		SetPageError(page);
+		mapping_set_error(page->mapping, rv);
+	}
+
+	end_page_writeback(page);
+
+	return rv;
+
+redirty:
+	redirty_page_for_writepage(wbc, page);
+	unlock_page(page);
+
+	return 0;
+}
+
+static int plgfs_reg_pc_aop_write_begin(struct file *f,
+		struct address_space *mapping, loff_t pos, unsigned len,
+		unsigned flags, struct page **pagep, void **fsdata)
+{
+	struct page *page;
+	int rv;
+
+	page = grab_cache_page_write_begin(mapping, pos >> PAGE_CACHE_SHIFT,
+			flags);
+	if (!page)
+		return -ENOMEM;
+
+	*pagep = page;
+
+	if (PageUptodate(page) || len == PAGE_CACHE_SIZE)
+		return 0;
+
+	/* nothing to transform past the end of file */
+	if (page_offset(page) >= i_size_read(mapping->host)) {
+		zero_user(page, 0, PAGE_CACHE_SIZE);
+		SetPageUptodate(page);
+		return 0;
+	}
+
+	rv = plgfs_pc_readpage(f, page);
+	if (!rv)
+		return 0;
+
+	unlock_page(page);
+	page_cache_release(page);
+
+	return rv;
+}
+
+/*
+ * A page which is not uptodate was not read in write_begin, because it is to
+ * be overwritten completely. After a short copy the rest of it still has to
+ * come from the hidden file, so nothing is taken and the write is retried,
+ * as block_write_end does.
+ */
+static int plgfs_reg_pc_aop_write_end(struct file *f,
+		struct address_space *mapping, loff_t pos, unsigned len,
+		unsigned copied, struct page *page, void *fsdata)
+{
+	struct inode *i;
+
+	i = mapping->host;
+
+	if (!PageUptodate(page)) {
+		if (copied < len) {
+			copied = 0;
+			goto unlock;
+		}
+
+		SetPageUptodate(page);
+	}
+
+	if (pos + copied > i_size_read(i))
+		i_size_write(i, pos + copied);
+
+	set_page_dirty(page);
+unlock:
+	unlock_page(page);
+	page_cache_release(page);
+
+	if (copied)
+		plgfs_dirty_add(i, pos, pos + copied);
+
+	return copied;
+}
+
+const struct address_space_operations plgfs_reg_pc_aops = {
+	.readpage = plgfs_reg_pc_aop_readpage,
+	.writepage = plgfs_reg_pc_aop_writepage,
+	.write_begin = plgfs_reg_pc_aop_write_begin,
+	.write_end = plgfs_reg_pc_aop_write_end,
+	.set_page_dirty = __set_page_dirty_nobuffers
+};
+
+static loff_t plgfs_reg_pc_fop_llseek(struct file *f, loff_t offset,
+		int origin)
+{
+	return plgfs_fop_llseek(f, offset, origin, PLGFS_REG_FOP_LLSEEK,
+			generic_file_llseek);
+}
+
+/*
+ * Writes are recorded in write_end, stores through a shared mapping when the
+ * page is made writable, so writepage does not record them again.
+ */
+static int plgfs_pc_vm_page_mkwrite(struct vm_area_struct *v,
+		struct vm_fault *vmf)
+{
+	loff_t start;
+	int rv;
+
+	rv = filemap_page_mkwrite(v, vmf);
+	if (rv & (VM_FAULT_ERROR | VM_FAULT_NOPAGE | VM_FAULT_RETRY))
+		return rv;
+
+	start = (loff_t)vmf->pgoff << PAGE_CACHE_SHIFT;
+	plgfs_dirty_add(v->vm_file->f_dentry->d_inode, start,
+			start + PAGE_CACHE_SIZE);
+
+	return rv;
+}
+
+static const struct vm_operations_struct plgfs_pc_vm_ops = {
+	.fault = filemap_fault,
+	.page_mkwrite = plgfs_pc_vm_page_mkwrite,
+	.remap_pages = generic_file_remap_pages
+};
+
+static int plgfs_reg_pc_fop_mmap(struct file *f, struct vm_area_struct *v)
+{
+	int rv;
+
+	rv = generic_file_mmap(f, v);
+	if (rv)
+		return rv;
+
+	v->vm_ops = &plgfs_pc_vm_ops;
+
+	return 0;
+}
+
+const struct file_operations plgfs_reg_pc_fops = {
+	.open = plgfs_reg_fop_open,
+	.release = plgfs_reg_fop_release,
+	.llseek = plgfs_reg_pc_fop_llseek,
+	.read = do_sync_read,
+	.write = do_sync_write,
+	.aio_read = generic_file_aio_read,
+	.aio_write = generic_file_aio_write,
+	.splice_read = generic_file_splice_read,
+	.splice_write = generic_file_splice_write,
+	.mmap = plgfs_reg_pc_fop_mmap,
+	.fsync = plgfs_reg_fop_fsync,
+#ifdef CONFIG_COMPAT
+	.compat_ioctl = plgfs_reg_fop_compat_ioctl,
+#endif
+	.unlocked_ioctl = plgfs_reg_fop_unlocked_ioctl,
+	.flush = plgfs_reg_fop_flush,
+	.fallocate = plgfs_reg_fop_fallocate
+};
+
 struct plgfs_file_info *plgfs_alloc_fi(struct file *f)
 {
 	struct plgfs_sb_info *sbi;
@@ -618,5 +2416,19 @@ struct plgfs_file_info *plgfs_alloc_fi(struct file *f)
 	if (!fi)
 		return ERR_PTR(-ENOMEM);
 
+	fi->data_plgs = sbi->data_plgs;
+
 	return fi;
 }
+
+void plgfs_free_fi(struct plgfs_sb_info *sbi, struct plgfs_file_info *fi)
+{
+	int idx;
+
+	for (idx = 0; idx < PLGFS_FI_CONT_NR; idx++) {
+		if (fi->cont[idx])
+			plgfs_free_context(sbi, fi->cont[idx]);
+	}
+
+	kmem_cache_free(sbi->cache->fi_cache, fi);
+}
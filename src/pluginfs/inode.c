@@ -26,6 +26,7 @@ static struct dentry *plgfs_dir_iop_lookup(struct inode *i, struct dentry *d,
 	struct plgfs_sb_info *sbi;
 	struct dentry *dph; /* dentry parent hidden */
 	struct dentry *dh; /* dentry hidden */
+	struct plgfs_dir_gen gen;
 	struct dentry *rv;
 
 	sbi = plgfs_sbi(i->i_sb);
@@ -54,6 +55,7 @@ static struct dentry *plgfs_dir_iop_lookup(struct inode *i, struct dentry *d,
 	}
 
 	mutex_lock(&dph->d_inode->i_mutex);
+	plgfs_get_dir_gen(dph->d_inode, &gen);
 	dh = lookup_one_len(d->d_name.name, dph, d->d_name.len);
 	mutex_unlock(&dph->d_inode->i_mutex);
 
@@ -65,6 +67,8 @@ static struct dentry *plgfs_dir_iop_lookup(struct inode *i, struct dentry *d,
 	plgfs_di(d)->dentry_hidden = dh;
 
 	if (!dh->d_inode) {
+		plgfs_di(d)->neg_gen = gen;
+		plgfs_di(d)->neg = 1;
 		d_add(d, NULL);
 		goto postcalls;
 	}
@@ -158,6 +162,8 @@ static int plgfs_iop_setattr(struct dentry *d, struct iattr *ia, int op_id)
 	struct plgfs_sb_info *sbi;
 	struct dentry *dh;
 	struct file *f;
+	loff_t size;
+	int pc;
 	int rv;
 
 	sbi = plgfs_sbi(d->d_inode->i_sb);
@@ -178,8 +184,15 @@ static int plgfs_iop_setattr(struct dentry *d, struct iattr *ia, int op_id)
 	ia = cont->op_args.i_setattr.iattr;
 	f = ia->ia_file;
 
-	if (ia->ia_valid & ATTR_FILE)
+	plgfs_fcache_purge(d->d_inode);
+
+	if (ia->ia_valid & ATTR_FILE) {
 		ia->ia_file = plgfs_fh(f);
+		if (IS_ERR(ia->ia_file)) {
+			cont->op_rv.rv_int = PTR_ERR(ia->ia_file);
+			goto postcalls;
+		}
+	}
 
 	if (ia->ia_valid & (ATTR_KILL_SUID | ATTR_KILL_SGID))
 		ia->ia_valid &= ~ATTR_MODE;
@@ -187,13 +200,50 @@ static int plgfs_iop_setattr(struct dentry *d, struct iattr *ia, int op_id)
 	d = cont->op_args.i_setattr.dentry;
 	ia = cont->op_args.i_setattr.iattr;
 	dh = plgfs_dh(d);
+	pc = (ia->ia_valid & ATTR_SIZE) && S_ISREG(d->d_inode->i_mode) &&
+		(sbi->flags & PLGFS_SBI_PAGECACHE);
+
+	/*
+	 * Own dirty pages past the new size are written back first, so
+	 * writeback does not extend the hidden file past it afterwards and
+	 * nothing is lost if the hidden truncate fails. Own page cache is
+	 * truncated only once the hidden file is.
+	 */
+	if (pc) {
+		cont->op_rv.rv_int = inode_change_ok(d->d_inode, ia);
+		if (cont->op_rv.rv_int)
+			goto postcalls;
+
+		size = i_size_read(d->d_inode);
+		if (ia->ia_size < size) {
+			cont->op_rv.rv_int = filemap_write_and_wait_range(
+					d->d_inode->i_mapping, ia->ia_size,
+					LLONG_MAX);
+			if (cont->op_rv.rv_int)
+				goto postcalls;
+		}
+	}
 
 	mutex_lock(&dh->d_inode->i_mutex);
+	if (!pc)
+		size = i_size_read(dh->d_inode);
 	cont->op_rv.rv_int = notify_change(dh, ia);
 	mutex_unlock(&dh->d_inode->i_mutex);
 
+	if (pc && !cont->op_rv.rv_int)
+		truncate_setsize(d->d_inode, ia->ia_size);
+
 	fsstack_copy_attr_all(d->d_inode, dh->d_inode);
 
+	if (!pc && (ia->ia_valid & ATTR_SIZE))
+		plgfs_ii_set_stale(d->d_inode);
+
+	/* truncate both drops and zero extends data */
+	if (!cont->op_rv.rv_int && (ia->ia_valid & ATTR_SIZE) &&
+			S_ISREG(d->d_inode->i_mode))
+		plgfs_dirty_add(d->d_inode, min(size, ia->ia_size),
+				max(size, ia->ia_size));
+
 postcalls:
 	plgfs_postcall_plgs(cont, sbi);
 
@@ -221,15 +271,106 @@ static int plgfs_lnk_iop_setattr(struct dentry *d, struct iattr *ia)
 	return plgfs_iop_setattr(d, ia, PLGFS_LNK_IOP_SETATTR);
 }
 
+static void plgfs_get_attr_gen(struct inode *i, struct plgfs_attr_gen *g)
+{
+	g->version = i->i_version;
+	g->atime = i->i_atime;
+	g->mtime = i->i_mtime;
+	g->ctime = i->i_ctime;
+	g->size = i_size_read(i);
+	g->blocks = i->i_blocks;
+	g->mode = i->i_mode;
+	g->uid = i->i_uid;
+	g->gid = i->i_gid;
+	g->nlink = i->i_nlink;
+}
+
+static int plgfs_attr_gen_eq(struct plgfs_attr_gen *a, struct plgfs_attr_gen *b)
+{
+	return a->version == b->version &&
+		timespec_equal(&a->atime, &b->atime) &&
+		timespec_equal(&a->mtime, &b->mtime) &&
+		timespec_equal(&a->ctime, &b->ctime) &&
+		a->size == b->size && a->blocks == b->blocks &&
+		a->mode == b->mode && uid_eq(a->uid, b->uid) &&
+		gid_eq(a->gid, b->gid) && a->nlink == b->nlink;
+}
+
+/*
+ * The stat of the hidden inode is kept together with the inode fields it was
+ * made from. The fields are taken before vfs_getattr, so a change racing with
+ * it makes the next getattr go to the hidden fs again. A hidden fs with its
+ * own getattr may report more than these fields hold, e.g. delayed
+ * allocation in st_blocks, so its stat is never kept.
+ */
+static int plgfs_getattr_hidden(struct plgfs_sb_info *sbi, struct dentry *d,
+		struct kstat *stat)
+{
+	struct plgfs_inode_info *ii;
+	struct plgfs_attr_gen gen;
+	struct path path;
+	struct inode *ih;
+	int cache;
+	int rv;
+
+	ii = plgfs_ii(d->d_inode);
+	ih = plgfs_dh(d)->d_inode;
+
+	plgfs_get_attr_gen(ih, &gen);
+
+	cache = (sbi->flags & PLGFS_SBI_ATTR_CACHE) && !ih->i_op->getattr;
+	if (!cache)
+		goto getattr;
+
+	spin_lock(&ii->attr_lock);
+
+	if (ii->attr_valid && plgfs_attr_gen_eq(&ii->attr_gen, &gen)) {
+		*stat = ii->attr;
+		spin_unlock(&ii->attr_lock);
+		goto done;
+	}
+
+	spin_unlock(&ii->attr_lock);
+
+getattr:
+	path.mnt = sbi->path_hidden.mnt;
+	path.dentry = plgfs_dh(d);
+
+	rv = vfs_getattr(&path, stat);
+	if (rv)
+		return rv;
+
+	fsstack_copy_attr_all(d->d_inode, ih);
+
+	if (cache) {
+		spin_lock(&ii->attr_lock);
+		ii->attr = *stat;
+		ii->attr_gen = gen;
+		ii->attr_valid = 1;
+		spin_unlock(&ii->attr_lock);
+	}
+done:
+	plgfs_ii_refresh(d->d_inode);
+
+	/* dirty pages not written back yet are not in the hidden size */
+	if (S_ISREG(d->d_inode->i_mode) && sbi->flags & PLGFS_SBI_PAGECACHE)
+		stat->size = i_size_read(d->d_inode);
+
+	return 0;
+}
+
 static int plgfs_iop_getattr(struct vfsmount *m, struct dentry *d,
 		struct kstat *stat, int op_id)
 {
 	struct plgfs_context *cont;
 	struct plgfs_sb_info *sbi;
-	struct path path;
 	int rv;
 
 	sbi = plgfs_sbi(d->d_inode->i_sb);
+
+	if (!plgfs_has_cbs(sbi, op_id))
+		return plgfs_getattr_hidden(sbi, d, stat);
+
 	cont = plgfs_alloc_context(sbi);
 	if (IS_ERR(cont))
 		return PTR_ERR(cont);
@@ -246,14 +387,7 @@ static int plgfs_iop_getattr(struct vfsmount *m, struct dentry *d,
 	d = cont->op_args.i_getattr.dentry;
 	stat = cont->op_args.i_getattr.stat;
 
-	path.mnt = sbi->path_hidden.mnt;
-	path.dentry = plgfs_dh(d);
-
-	cont->op_rv.rv_int = vfs_getattr(&path, stat);
-	if (cont->op_rv.rv_int)
-		goto postcalls;
-
-	fsstack_copy_attr_all(d->d_inode, plgfs_dh(d)->d_inode);
+	cont->op_rv.rv_int = plgfs_getattr_hidden(sbi, d, stat);
 
 postcalls:
 	plgfs_postcall_plgs(cont, sbi);
@@ -308,6 +442,9 @@ static int plgfs_dir_iop_unlink(struct inode *ip, struct dentry *d)
 	iph = plgfs_ih(ip);
 	ih = plgfs_dh(d)->d_inode;
 
+	/* cached hidden files would keep the unlinked inode alive */
+	plgfs_fcache_purge(d->d_inode);
+
 	mutex_lock_nested(&iph->i_mutex, I_MUTEX_PARENT);
 	cont->op_rv.rv_int = vfs_unlink(iph, plgfs_dh(d));
 	mutex_unlock(&iph->i_mutex);
@@ -463,6 +600,10 @@ static int plgfs_dir_iop_rename(struct inode *oi, struct dentry *od,
 	nih = plgfs_ih(ni);
 	ndh = plgfs_dh(nd);
 
+	plgfs_fcache_purge(od->d_inode);
+	if (nd->d_inode)
+		plgfs_fcache_purge(nd->d_inode);
+
 	trap = lock_rename(ndh->d_parent, odh->d_parent);
 
 	if (trap == odh) {
@@ -808,10 +949,24 @@ static int plgfs_iop_permission(struct inode *i, int mask, int op_id)
 {
 	struct plgfs_context *cont;
 	struct plgfs_sb_info *sbi;
+	int rcu;
 	int rv;
 
 	sbi = plgfs_sbi(i->i_sb);
-	cont = plgfs_alloc_context_atomic(sbi);
+
+	if (!plgfs_has_cbs(sbi, op_id))
+		return inode_permission(plgfs_ih(i), mask);
+
+	/* rcu-walk, see plgfs_d_revalidate */
+	rcu = mask & MAY_NOT_BLOCK;
+	if (rcu && (sbi->flags & PLGFS_SBI_NO_RCU))
+		return -ECHILD;
+
+	if (rcu)
+		cont = plgfs_get_context_rcu(sbi);
+	else
+		cont = plgfs_alloc_context(sbi);
+
 	if (IS_ERR(cont))
 		return PTR_ERR(cont);
 
@@ -832,7 +987,10 @@ postcalls:
 
 	rv = cont->op_rv.rv_int;
 
-	plgfs_free_context(sbi, cont);
+	if (rcu)
+		plgfs_put_context_rcu(sbi);
+	else
+		plgfs_free_context(sbi, cont);
 
 	return rv;
 }
@@ -1086,6 +1244,59 @@ static const struct inode_operations plgfs_lnk_iops= {
 	.removexattr = plgfs_lnk_iop_removexattr
 };
 
+static int plgfs_reg_iop_fiemap(struct inode *i,
+		struct fiemap_extent_info *fieinfo, u64 start, u64 len)
+{
+	struct plgfs_context *cont;
+	struct plgfs_sb_info *sbi;
+	struct inode *ih;
+	int rv;
+
+	sbi = plgfs_sbi(i->i_sb);
+	cont = plgfs_alloc_context(sbi);
+	if (IS_ERR(cont))
+		return PTR_ERR(cont);
+
+	cont->op_id = PLGFS_REG_IOP_FIEMAP;
+	cont->op_args.i_fiemap.inode = i;
+	cont->op_args.i_fiemap.fieinfo = fieinfo;
+	cont->op_args.i_fiemap.start = start;
+	cont->op_args.i_fiemap.len = len;
+
+	if (!plgfs_precall_plgs(cont, sbi))
+		goto postcalls;
+
+	i = cont->op_args.i_fiemap.inode;
+	fieinfo = cont->op_args.i_fiemap.fieinfo;
+	start = cont->op_args.i_fiemap.start;
+	len = cont->op_args.i_fiemap.len;
+
+	ih = plgfs_ih(i);
+
+	cont->op_rv.rv_int = -EOPNOTSUPP;
+
+	if (!ih->i_op->fiemap)
+		goto postcalls;
+
+	/* ioctl_fiemap synced only our mapping */
+	if (fieinfo->fi_flags & FIEMAP_FLAG_SYNC) {
+		cont->op_rv.rv_int = filemap_write_and_wait(ih->i_mapping);
+		if (cont->op_rv.rv_int)
+			goto postcalls;
+	}
+
+	cont->op_rv.rv_int = ih->i_op->fiemap(ih, fieinfo, start, len);
+
+postcalls:
+	plgfs_postcall_plgs(cont, sbi);
+
+	rv = cont->op_rv.rv_int;
+
+	plgfs_free_context(sbi, cont);
+
+	return rv;
+}
+
 static const struct inode_operations plgfs_reg_iops= {
 	.setattr = plgfs_reg_iop_setattr,
 	.getattr = plgfs_reg_iop_getattr,
@@ -1093,7 +1304,8 @@ static const struct inode_operations plgfs_reg_iops= {
 	.setxattr = plgfs_reg_iop_setxattr,
 	.getxattr = plgfs_reg_iop_getxattr,
 	.listxattr = plgfs_reg_iop_listxattr,
-	.removexattr = plgfs_reg_iop_removexattr
+	.removexattr = plgfs_reg_iop_removexattr,
+	.fiemap = plgfs_reg_iop_fiemap
 };
 
 static const struct inode_operations plgfs_dir_iops= {
@@ -1137,9 +1349,21 @@ static int plgfs_inode_set(struct inode *i, void *data)
 	fsstack_copy_attr_all(i, ih);
 	fsstack_copy_inode_size(i, ih);
 
-	if (S_ISREG(i->i_mode)) {
+	if (S_ISREG(i->i_mode) &&
+			plgfs_sbi(i->i_sb)->flags & PLGFS_SBI_PAGECACHE) {
+		i->i_op = &plgfs_reg_iops;
+		i->i_fop = &plgfs_reg_pc_fops;
+		i->i_data.a_ops = &plgfs_reg_pc_aops;
+	} else if (S_ISREG(i->i_mode) &&
+			plgfs_sbi(i->i_sb)->flags & PLGFS_SBI_ALIAS) {
+		i->i_op = &plgfs_reg_iops;
+		i->i_fop = &plgfs_reg_alias_fops;
+		i->i_data.a_ops = &plgfs_reg_aops;
+		i->i_mapping = ih->i_mapping;
+	} else if (S_ISREG(i->i_mode)) {
 		i->i_op = &plgfs_reg_iops;
 		i->i_fop = &plgfs_reg_fops;
+		i->i_data.a_ops = &plgfs_reg_aops;
 	} else if (S_ISDIR(i->i_mode)) {
 		i->i_op = &plgfs_dir_iops;
 		i->i_fop = &plgfs_dir_fops;
@@ -1170,7 +1394,9 @@ struct inode *plgfs_iget(struct super_block *sb, unsigned long ino)
 
 	if (!(i->i_state & I_NEW)) {
 		fsstack_copy_attr_all(i, ih);
-		fsstack_copy_inode_size(i, ih);
+		/* with own page cache our size may be ahead of the hidden one */
+		if (!(plgfs_sbi(sb)->flags & PLGFS_SBI_PAGECACHE))
+			fsstack_copy_inode_size(i, ih);
 		iput(ih);
 		return i;
 	}
@@ -1188,5 +1414,18 @@ struct plgfs_inode_info *plgfs_alloc_ii(struct plgfs_sb_info *sbi)
 	if (!ii)
 		return ERR_PTR(-ENOMEM);
 
+	spin_lock_init(&ii->dirty_lock);
+	INIT_LIST_HEAD(&ii->dirty);
+	ii->dirty_nr = 0;
+	ii->dirty_lost = 0;
+	ii->vm_ops = NULL;
+	ii->file_hidden = NULL;
+	ii->pc_writers = 0;
+	INIT_LIST_HEAD(&ii->fcache);
+	ii->fcache_nr = 0;
+	ii->flags = 0;
+	spin_lock_init(&ii->attr_lock);
+	ii->attr_valid = 0;
+
 	return ii;
 }
@@ -105,6 +105,81 @@ void plgfs_free_context(struct plgfs_sb_info *sbi, struct plgfs_context *cont)
 	kmem_cache_free(sbi->cache->ci_cache, cont);
 }
 
+/*
+ * Ops which must not block, d_hash, d_compare and rcu-walk revalidate and
+ * permission, use the context of the current cpu. Preemption stays disabled
+ * until it is put, which is fine since plugins cannot sleep there anyway.
+ */
+struct plgfs_context *plgfs_get_context_rcu(struct plgfs_sb_info *sbi)
+{
+	struct plgfs_context *cont;
+
+	cont = per_cpu_ptr(sbi->cont_rcu, get_cpu());
+	memset(cont, 0, sizeof(struct plgfs_context) +
+			sizeof(void *) * sbi->plgs_nr);
+
+	return cont;
+}
+
+void plgfs_put_context_rcu(struct plgfs_sb_info *sbi)
+{
+	put_cpu();
+}
+
+/*
+ * Data path ops use one of the contexts kept by the open file. A slot gets
+ * its context on the first data op which takes it, so opens which never do
+ * any I/O don't pay for them. A context not kept in any slot is allocated
+ * only when all of them are taken by concurrent or nested calls.
+ */
+struct plgfs_context *plgfs_alloc_fi_context(struct plgfs_sb_info *sbi,
+		struct plgfs_file_info *fi)
+{
+	struct plgfs_context *cont;
+	int idx;
+
+	for (idx = 0; idx < PLGFS_FI_CONT_NR; idx++) {
+		if (test_and_set_bit_lock(idx, &fi->cont_busy))
+			continue;
+
+		/* the slot is ours while its bit is set */
+		cont = fi->cont[idx];
+		if (!cont) {
+			cont = plgfs_alloc_context(sbi);
+			if (IS_ERR(cont)) {
+				clear_bit_unlock(idx, &fi->cont_busy);
+				return cont;
+			}
+
+			fi->cont[idx] = cont;
+			return cont;
+		}
+
+		memset(cont, 0, sizeof(struct plgfs_context) +
+				sizeof(void *) * sbi->plgs_nr);
+
+		return cont;
+	}
+
+	return plgfs_alloc_context(sbi);
+}
+
+void plgfs_free_fi_context(struct plgfs_sb_info *sbi,
+		struct plgfs_file_info *fi, struct plgfs_context *cont)
+{
+	int idx;
+
+	for (idx = 0; idx < PLGFS_FI_CONT_NR; idx++) {
+		if (fi->cont[idx] != cont)
+			continue;
+
+		clear_bit_unlock(idx, &fi->cont_busy);
+		return;
+	}
+
+	plgfs_free_context(sbi, cont);
+}
+
 static int plgfs_test_super(struct super_block *sb, void *data)
 {
 	struct plgfs_mnt_cfg *cfg;
@@ -123,6 +198,14 @@ static int plgfs_test_super(struct super_block *sb, void *data)
 
 	cfg->flags |= PLGFS_OPT_DIFF_PLGS;
 
+	if (!(sbi->flags & PLGFS_SBI_PAGECACHE) !=
+			!(cfg->flags & PLGFS_OPT_PAGECACHE))
+		return 0;
+
+	if (!(sbi->flags & PLGFS_SBI_READDIRPLUS) !=
+			!(cfg->flags & PLGFS_OPT_READDIRPLUS))
+		return 0;
+
 	if (sbi->plgs_nr != cfg->plgs_nr)
 		return 0;
 
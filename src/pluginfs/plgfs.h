@@ -46,9 +46,16 @@
 #include <linux/blkdev.h>
 #include <linux/blk_types.h>
 #include <linux/aio.h>
+#include <linux/uio.h>
 #include <linux/string.h>
 #include <linux/xattr.h>
+#include <linux/fsnotify.h>
 #include <linux/statfs.h>
+#include <linux/writeback.h>
+#include <linux/workqueue.h>
+#include <linux/splice.h>
+#include <linux/percpu.h>
+#include <linux/rcupdate.h>
 #include "pluginfs.h"
 
 #define PLGFS_VERSION "0.001"
@@ -56,6 +63,17 @@
 #define PLGFS_MAGIC 0x504C47
 
 #define PLGFS_OPT_DIFF_PLGS 1
+#define PLGFS_OPT_PAGECACHE 2
+#define PLGFS_OPT_READDIRPLUS 4
+
+#define PLGFS_SBI_TRACK_DIRTY 0x01
+#define PLGFS_SBI_PAGECACHE 0x02 /* regular files have their own page cache */
+#define PLGFS_SBI_ALIAS 0x04 /* regular files use the hidden mapping */
+#define PLGFS_SBI_NO_RCU 0x08 /* some plugin cannot be called in rcu-walk */
+#define PLGFS_SBI_ATTR_CACHE 0x10 /* getattr results are kept in inodes */
+#define PLGFS_SBI_READDIRPLUS 0x20 /* iterate instantiates the entries */
+
+#define PLGFS_II_STALE 0 /* size and times of the hidden inode not copied */
 
 struct plgfs_mnt_cfg {
 	int  plgs_nr;
@@ -110,6 +128,14 @@ struct plgfs_sb_info {
 	struct mutex mutex_walk;
 	struct plgfs_plugin **plgs;
 	unsigned int plgs_nr;
+	unsigned int flags;
+	DECLARE_BITMAP(cbs, PLGFS_OP_NR); /* ops some plugin has callbacks for */
+	unsigned long data_plgs; /* plugins with data path callbacks */
+	struct plgfs_context __percpu *cont_rcu; /* for non-blocking ops */
+	spinlock_t fcache_lock;
+	struct list_head fcache_lru; /* protected by fcache_lock */
+	long fcache_nr;
+	struct delayed_work fcache_work;
 	void **priv;
 	void *data[0];
 };
@@ -124,12 +150,40 @@ static inline struct super_block *plgfs_sbh(struct super_block *sb)
 	return plgfs_sbi(sb)->path_hidden.mnt->mnt_sb;
 }
 
+static inline int plgfs_has_cbs(struct plgfs_sb_info *sbi,
+		enum plgfs_op_id op_id)
+{
+	return test_bit(op_id, sbi->cbs);
+}
+
 extern int plgfs_fill_super(struct super_block *, int, struct plgfs_mnt_cfg *);
 
+/* change counters of a hidden directory */
+struct plgfs_dir_gen {
+	u64 version;
+	struct timespec mtime;
+};
+
+static inline void plgfs_get_dir_gen(struct inode *i, struct plgfs_dir_gen *g)
+{
+	g->version = i->i_version;
+	g->mtime = i->i_mtime;
+}
+
+static inline int plgfs_dir_gen_eq(struct plgfs_dir_gen *a,
+		struct plgfs_dir_gen *b)
+{
+	return a->version == b->version && timespec_equal(&a->mtime, &b->mtime);
+}
+
 struct plgfs_dentry_info {
 	struct dentry *dentry_hidden;
 	struct dentry *dentry_walk;
 	struct list_head list_walk; /* pretected by mutex_walk in sbi */
+	struct plgfs_dir_gen neg_gen; /* hidden parent when found negative */
+	unsigned int neg;
+	struct kmem_cache *cache;
+	struct rcu_head rcu; /* rcu-walk may still look at a released dentry */
 	void *priv[0];
 };
 
@@ -146,10 +200,47 @@ static inline struct dentry *plgfs_dh(struct dentry *d)
 extern struct plgfs_dentry_info *plgfs_alloc_di(struct dentry *);
 
 extern const struct dentry_operations plgfs_dops;
+extern const struct dentry_operations *plgfs_get_dops(struct plgfs_sb_info *,
+		struct dentry *);
+
+/* fields of a hidden inode reported by getattr which may change */
+struct plgfs_attr_gen {
+	u64 version;
+	struct timespec atime;
+	struct timespec mtime;
+	struct timespec ctime;
+	loff_t size;
+	blkcnt_t blocks;
+	umode_t mode;
+	kuid_t uid;
+	kgid_t gid;
+	unsigned int nlink;
+};
+
+/* vm_ops of the hidden file wrapped to catch writes through shared mmaps */
+struct plgfs_vm_ops {
+	struct vm_operations_struct ops;
+	const struct vm_operations_struct *ops_hidden;
+	struct inode *inode;
+};
 
 struct plgfs_inode_info {
 	struct inode vfs_inode;
 	struct inode *inode_hidden;
+	spinlock_t dirty_lock;
+	struct list_head dirty; /* protected by dirty_lock */
+	unsigned int dirty_nr;
+	unsigned int dirty_lost;
+	struct plgfs_vm_ops *vm_ops;
+	struct file *file_hidden; /* backs the page cache, protected by i_lock */
+	unsigned int pc_writers; /* our files open for writing, under i_lock */
+	struct list_head fcache; /* protected by fcache_lock in sbi */
+	unsigned int fcache_nr;
+	unsigned long flags;
+	spinlock_t attr_lock;
+	struct kstat attr; /* protected by attr_lock */
+	struct plgfs_attr_gen attr_gen; /* of the hidden inode for attr */
+	unsigned int attr_valid;
 	void *priv[0];
 };
 
@@ -163,28 +254,70 @@ static inline struct inode *plgfs_ih(struct inode *i)
 	return plgfs_ii(i)->inode_hidden;
 }
 
+/*
+ * Writers only mark the inode, so parallel appenders don't keep writing the
+ * size and times into our inode. The bit is tested first to avoid dirtying
+ * its cache line when it is already set.
+ */
+static inline void plgfs_ii_set_stale(struct inode *i)
+{
+	if (!test_bit(PLGFS_II_STALE, &plgfs_ii(i)->flags))
+		set_bit(PLGFS_II_STALE, &plgfs_ii(i)->flags);
+}
+
+static inline void plgfs_ii_refresh(struct inode *i)
+{
+	if (!test_bit(PLGFS_II_STALE, &plgfs_ii(i)->flags))
+		return;
+
+	if (!test_and_clear_bit(PLGFS_II_STALE, &plgfs_ii(i)->flags))
+		return;
+
+	fsstack_copy_inode_size(i, plgfs_ih(i));
+	fsstack_copy_attr_times(i, plgfs_ih(i));
+}
+
 extern struct plgfs_inode_info *plgfs_alloc_ii(struct plgfs_sb_info *sbi);
 extern struct inode *plgfs_iget(struct super_block *, unsigned long);
 
+
+extern void plgfs_dirty_add(struct inode *, loff_t, loff_t);
+extern void plgfs_dirty_lost(struct inode *);
+
+extern struct file *plgfs_fcache_get(struct inode *, int, const struct cred *);
+extern int plgfs_fcache_put(struct inode *, struct file *);
+extern void plgfs_fcache_purge(struct inode *);
+extern long plgfs_fcache_shrink(struct plgfs_sb_info *, long);
+extern void plgfs_fcache_work(struct work_struct *);
+
+#define PLGFS_FI_CONT_NR 2
+
 struct plgfs_file_info {
 	struct file *file_hidden;
+	/* contexts reused by the data path, slot i is busy if bit i is set */
+	struct plgfs_context *cont[PLGFS_FI_CONT_NR];
+	unsigned long cont_busy;
+	/* plugins still interested in the data, read/write bypass them at 0 */
+	unsigned long data_plgs;
 	void *priv[0];
 };
 
 extern struct plgfs_file_info *plgfs_alloc_fi(struct file *);
+extern void plgfs_free_fi(struct plgfs_sb_info *, struct plgfs_file_info *);
 
 static inline struct plgfs_file_info *plgfs_fi(struct file *f)
 {
 	return f->private_data;
 }
 
-static inline struct file *plgfs_fh(struct file *f)
-{
-	return plgfs_fi(f)->file_hidden;
-}
+extern struct file *plgfs_fh(struct file *);
 
 extern const struct file_operations plgfs_reg_fops;
+extern const struct file_operations plgfs_reg_pc_fops;
+extern const struct file_operations plgfs_reg_alias_fops;
 extern const struct file_operations plgfs_dir_fops;
+extern const struct address_space_operations plgfs_reg_aops;
+extern const struct address_space_operations plgfs_reg_pc_aops;
 
 extern struct plgfs_plugin *plgfs_get_plg(const char *);
 extern inline void plgfs_put_plg(struct plgfs_plugin *);
@@ -198,6 +331,12 @@ extern void plgfs_postcall_plgs(struct plgfs_context *, struct plgfs_sb_info *);
 extern struct plgfs_context *plgfs_alloc_context_atomic(struct plgfs_sb_info *);
 extern struct plgfs_context *plgfs_alloc_context(struct plgfs_sb_info *);
 extern void plgfs_free_context(struct plgfs_sb_info *, struct plgfs_context *);
+extern struct plgfs_context *plgfs_get_context_rcu(struct plgfs_sb_info *);
+extern void plgfs_put_context_rcu(struct plgfs_sb_info *);
+extern struct plgfs_context *plgfs_alloc_fi_context(struct plgfs_sb_info *,
+		struct plgfs_file_info *);
+extern void plgfs_free_fi_context(struct plgfs_sb_info *,
+		struct plgfs_file_info *, struct plgfs_context *);
 
 extern struct file_system_type plgfs_type;
 
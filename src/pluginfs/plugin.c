@@ -168,6 +168,27 @@ void plgfs_set_file_priv(struct file *f, int plg_sb_id, void *data)
 	plgfs_fi(f)->priv[plg_sb_id] = data;
 }
 
+/*
+ * Tells that the plugin has no further interest in the data read or written
+ * through this open file. Once all plugins with data path callbacks said so,
+ * read and write go directly to the hidden file and their callbacks are not
+ * called for it anymore. Usually done by the open post call.
+ */
+void plgfs_set_file_data_clean(struct file *f, int plg_sb_id)
+{
+	struct plgfs_file_info *fi;
+
+	if (plg_sb_id >= BITS_PER_LONG)
+		return;
+
+	/* open failed or was vetoed */
+	fi = plgfs_fi(f);
+	if (!fi)
+		return;
+
+	clear_bit(plg_sb_id, &fi->data_plgs);
+}
+
 void *plgfs_get_dentry_priv(struct dentry *d, int plg_sb_id)
 {
 	return plgfs_di(d)->priv[plg_sb_id];
@@ -196,6 +217,7 @@ EXPORT_SYMBOL(plgfs_get_sb_priv);
 EXPORT_SYMBOL(plgfs_set_sb_priv);
 EXPORT_SYMBOL(plgfs_get_file_priv);
 EXPORT_SYMBOL(plgfs_set_file_priv);
+EXPORT_SYMBOL(plgfs_set_file_data_clean);
 EXPORT_SYMBOL(plgfs_get_dentry_priv);
 EXPORT_SYMBOL(plgfs_set_dentry_priv);
 EXPORT_SYMBOL(plgfs_get_inode_priv);
@@ -33,11 +33,21 @@ enum plgfs_op_id {
 	PLGFS_REG_FOP_LLSEEK,
 	PLGFS_REG_FOP_READ,
 	PLGFS_REG_FOP_WRITE,
+	PLGFS_REG_FOP_READ_XFORM,
+	PLGFS_REG_FOP_WRITE_XFORM,
+	PLGFS_REG_FOP_AIO_READ,
+	PLGFS_REG_FOP_AIO_WRITE,
 	PLGFS_REG_FOP_FSYNC,
 	PLGFS_REG_FOP_MMAP,
 	PLGFS_REG_FOP_COMPAT_IOCTL,
 	PLGFS_REG_FOP_UNLOCKED_IOCTL,
 	PLGFS_REG_FOP_FLUSH,
+	PLGFS_REG_FOP_SPLICE_READ,
+	PLGFS_REG_FOP_SPLICE_WRITE,
+	PLGFS_REG_FOP_FALLOCATE,
+	PLGFS_REG_AOP_DIRECT_IO,
+	PLGFS_REG_AOP_READPAGE,
+	PLGFS_REG_AOP_WRITEPAGE,
 	PLGFS_REG_IOP_SETATTR,
 	PLGFS_REG_IOP_GETATTR,
 	PLGFS_REG_IOP_PERMISSION,
@@ -45,6 +55,7 @@ enum plgfs_op_id {
 	PLGFS_REG_IOP_GETXATTR,
 	PLGFS_REG_IOP_LISTXATTR,
 	PLGFS_REG_IOP_REMOVEXATTR,
+	PLGFS_REG_IOP_FIEMAP,
 	PLGFS_DIR_IOP_UNLINK,
 	PLGFS_DIR_IOP_MKDIR,
 	PLGFS_DIR_IOP_RMDIR,
@@ -80,6 +91,7 @@ enum plgfs_op_id {
 	PLGFS_LNK_IOP_REMOVEXATTR,
 	PLGFS_SOP_REMOUNT_FS,
 	PLGFS_SOP_STATFS,
+	PLGFS_SOP_SYNC_FS,
 	PLGFS_SOP_PUT_SUPER,
 	PLGFS_SOP_SHOW_OPTIONS,
 	PLGFS_SOP_ALLOC_INODE,
@@ -143,6 +155,41 @@ union plgfs_op_args {
 		loff_t *pos;
 	} f_write;
 
+	/*
+	 * Data in a kernel buffer transformed in place, the length has to stay
+	 * the same. READ_XFORM pre calls are done in chain order after data
+	 * were read from the hidden file, WRITE_XFORM post calls in reverse
+	 * order before data are written to it. An error can be returned in
+	 * rv_int.
+	 */
+	struct {
+		struct file *file;
+		char *buf;
+		size_t count;
+		loff_t pos;
+	} f_xform;
+
+	/*
+	 * Also used for readv and writev. With plugins hooking READ or WRITE
+	 * a sync request is passed on to them segment by segment, as the VFS
+	 * does without aio ops. Post calls of an async request get NULL iocb
+	 * and iov, they may already be freed by the hidden fs and must not be
+	 * touched.
+	 */
+	struct {
+		struct kiocb *iocb;
+		const struct iovec *iov;
+		unsigned long nr_segs;
+		loff_t pos;
+	} f_aio_read;
+
+	struct {
+		struct kiocb *iocb;
+		const struct iovec *iov;
+		unsigned long nr_segs;
+		loff_t pos;
+	} f_aio_write;
+
 	struct {
 		struct file *file;
 		loff_t start;
@@ -172,6 +219,48 @@ union plgfs_op_args {
 		fl_owner_t id;
 	} f_flush;
 
+	struct {
+		struct file *file;
+		loff_t *pos;
+		struct pipe_inode_info *pipe;
+		size_t len;
+		unsigned int flags;
+	} f_splice_read;
+
+	struct {
+		struct pipe_inode_info *pipe;
+		struct file *file;
+		loff_t *pos;
+		size_t len;
+		unsigned int flags;
+	} f_splice_write;
+
+	struct {
+		struct file *file;
+		int mode;
+		loff_t offset;
+		loff_t len;
+	} f_fallocate;
+
+	struct {
+		int rw;
+		struct kiocb *iocb;
+		const struct iovec *iov;
+		loff_t offset;
+		unsigned long nr_segs;
+	} a_direct_io;
+
+	struct {
+		struct file *file;
+		struct page *page;
+	} a_readpage;
+
+	struct {
+		struct page *page;
+		struct page *data; /* copy of page written to the hidden file */
+		struct writeback_control *wbc;
+	} a_writepage;
+
 	struct {
 		struct dentry *dentry;
 	} d_release;
@@ -205,6 +294,13 @@ union plgfs_op_args {
 		struct kstat *stat;
 	} i_getattr;
 
+	struct {
+		struct inode *inode;
+		struct fiemap_extent_info *fieinfo;
+		u64 start;
+		u64 len;
+	} i_fiemap;
+
 	struct {
 		struct inode *inode;
 		int mask;
@@ -319,6 +415,11 @@ union plgfs_op_args {
 		struct kstatfs *buf;
 	} s_statfs;
 
+	struct {
+		struct super_block *sb;
+		int wait;
+	} s_sync_fs;
+
 	struct {
 		struct super_block *sb;
 	} s_put_super;
@@ -370,6 +471,13 @@ struct plgfs_op_cbs {
 };
 
 #define PLGFS_PLG_HAS_OPTS 0x01
+/* keep byte ranges written to regular files, see plgfs_get_dirty_ranges */
+#define PLGFS_PLG_TRACK_DIRTY 0x02
+/*
+ * revalidate and permission callbacks may sleep, rcu-walk falls back to
+ * ref-walk for ops the plugin has callbacks for
+ */
+#define PLGFS_PLG_NO_RCU 0x04
 
 struct plgfs_plugin {
 	struct module *owner;
@@ -388,6 +496,7 @@ extern void *plgfs_get_sb_priv(struct super_block *, int);
 extern void plgfs_set_sb_priv(struct super_block *, int, void *);
 extern void *plgfs_get_file_priv(struct file *, int);
 extern void plgfs_set_file_priv(struct file *, int, void *);
+extern void plgfs_set_file_data_clean(struct file *, int);
 extern void *plgfs_get_dentry_priv(struct dentry *, int);
 extern void plgfs_set_dentry_priv(struct dentry *, int, void *);
 extern void *plgfs_get_inode_priv(struct inode *, int);
@@ -398,4 +507,12 @@ extern int plgfs_walk_dtree(struct plgfs_plugin *, struct dentry *,
 
 extern void plgfs_pass_on_option(char *, char *);
 
+struct plgfs_range {
+	loff_t start;
+	loff_t end; /* exclusive */
+};
+
+extern int plgfs_get_dirty_ranges(struct inode *, struct plgfs_range *, int);
+extern void plgfs_clear_dirty_ranges(struct inode *);
+
 #endif
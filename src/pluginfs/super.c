@@ -21,19 +21,105 @@
 
 static void plgfs_evict_inode(struct inode *i)
 {
+	if (i->i_nlink && mapping_tagged(&i->i_data, PAGECACHE_TAG_DIRTY))
+		filemap_write_and_wait(&i->i_data);
+
 	if (i->i_data.nrpages)
 		truncate_inode_pages(&i->i_data, 0);
 
 	clear_inode(i);
 
+	plgfs_clear_dirty_ranges(i);
+	plgfs_fcache_purge(i);
+	kfree(plgfs_ii(i)->vm_ops);
+
+	if (plgfs_ii(i)->file_hidden)
+		fput(plgfs_ii(i)->file_hidden);
+
 	iput(plgfs_ih(i));
 }
 
+/*
+ * Our dirty inodes, if any, were already written by the caller. Flush the
+ * hidden sb the way sync_filesystem would, so one syncfs on our mount makes
+ * everything written through it stable.
+ */
+static int plgfs_sync_fs(struct super_block *sb, int wait)
+{
+	struct plgfs_context *cont;
+	struct plgfs_sb_info *sbi;
+	struct super_block *sbh;
+	int rv;
+
+	sbi = plgfs_sbi(sb);
+	cont = plgfs_alloc_context(sbi);
+	if (IS_ERR(cont))
+		return PTR_ERR(cont);
+
+	cont->op_id = PLGFS_SOP_SYNC_FS;
+	cont->op_args.s_sync_fs.sb = sb;
+	cont->op_args.s_sync_fs.wait = wait;
+
+	if (!plgfs_precall_plgs(cont, sbi))
+		goto postcalls;
+
+	sb = cont->op_args.s_sync_fs.sb;
+	wait = cont->op_args.s_sync_fs.wait;
+
+	sbh = plgfs_sbh(sb);
+
+	if (sbh->s_flags & MS_RDONLY)
+		goto postcalls;
+
+	down_read(&sbh->s_umount);
+
+	if (wait)
+		sync_inodes_sb(sbh);
+	else
+		writeback_inodes_sb(sbh, WB_REASON_SYNC);
+
+	if (sbh->s_op->sync_fs)
+		cont->op_rv.rv_int = sbh->s_op->sync_fs(sbh, wait);
+
+	up_read(&sbh->s_umount);
+
+	if (cont->op_rv.rv_int || !sbh->s_bdev)
+		goto postcalls;
+
+	if (wait)
+		cont->op_rv.rv_int = sync_blockdev(sbh->s_bdev);
+	else
+		cont->op_rv.rv_int = filemap_flush(sbh->s_bdev->bd_inode->i_mapping);
+
+postcalls:
+	plgfs_postcall_plgs(cont, sbi);
+
+	rv = cont->op_rv.rv_int;
+
+	plgfs_free_context(sbi, cont);
+
+	return rv;
+}
+
+static long plgfs_nr_cached_objects(struct super_block *sb, int nid)
+{
+	return plgfs_sbi(sb)->fcache_nr;
+}
+
+static long plgfs_free_cached_objects(struct super_block *sb, long nr,
+		int nid)
+{
+	return plgfs_fcache_shrink(plgfs_sbi(sb), nr);
+}
+
 static void plgfs_free_sbi(struct plgfs_sb_info *sbi)
 {
 	if (!sbi)
 		return;
 
+	/* all cached files were released when our inodes were evicted */
+	cancel_delayed_work_sync(&sbi->fcache_work);
+
 	path_put(&sbi->path_hidden);
 
 	if (sbi->mnt_hidden)
@@ -48,6 +134,8 @@ static void plgfs_free_sbi(struct plgfs_sb_info *sbi)
 	if (sbi->pdev)
 		plgfs_rem_dev(sbi->pdev);
 
+	free_percpu(sbi->cont_rcu);
+
 	kfree(sbi);
 }
 
@@ -199,6 +287,12 @@ static int plgfs_show_options(struct seq_file *seq, struct dentry *d)
 
 	seq_printf(seq, ",fstype=%s", fsth->name);
 
+	if (sbi->flags & PLGFS_SBI_PAGECACHE)
+		seq_printf(seq, ",pagecache");
+
+	if (sbi->flags & PLGFS_SBI_READDIRPLUS)
+		seq_printf(seq, ",readdirplus");
+
 	seq_printf(seq, ",plugins=%s", sbi->plgs[0]->name);
 
 	for (i = 1; i < sbi->plgs_nr; i++) {
@@ -305,6 +399,9 @@ static const struct super_operations plgfs_sops = {
 	.show_options = plgfs_show_options,
 	.remount_fs = plgfs_remount_fs,
 	.statfs = plgfs_statfs,
+	.sync_fs = plgfs_sync_fs,
+	.nr_cached_objects = plgfs_nr_cached_objects,
+	.free_cached_objects = plgfs_free_cached_objects,
 	.alloc_inode = plgfs_alloc_inode,
 	.destroy_inode = plgfs_destroy_inode
 };
@@ -359,10 +456,33 @@ static struct vfsmount *plgfs_mount_hidden_unknown(int flags,
 	return ERR_PTR(-ENODEV);
 }
 
+static const enum plgfs_op_id plgfs_data_ops[] = {
+	PLGFS_REG_FOP_READ,
+	PLGFS_REG_FOP_WRITE,
+	PLGFS_REG_FOP_AIO_READ,
+	PLGFS_REG_FOP_AIO_WRITE,
+	PLGFS_REG_FOP_READ_XFORM,
+	PLGFS_REG_FOP_WRITE_XFORM
+};
+
+static int plgfs_has_data_cbs(struct plgfs_plugin *plg)
+{
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(plgfs_data_ops); i++) {
+		if (plg->cbs[plgfs_data_ops[i]].pre ||
+				plg->cbs[plgfs_data_ops[i]].post)
+			return 1;
+	}
+
+	return 0;
+}
+
 static struct plgfs_sb_info *plgfs_alloc_sbi(struct plgfs_mnt_cfg *cfg)
 {
 	struct plgfs_sb_info *sbi;
 	size_t size;
+	int op;
 	int i;
 
 	size = sizeof(struct plgfs_sb_info);
@@ -372,17 +492,36 @@ static struct plgfs_sb_info *plgfs_alloc_sbi(struct plgfs_mnt_cfg *cfg)
 	if (!sbi)
 		return ERR_PTR(-ENOMEM);
 
+	spin_lock_init(&sbi->fcache_lock);
+	INIT_LIST_HEAD(&sbi->fcache_lru);
+	INIT_DELAYED_WORK(&sbi->fcache_work, plgfs_fcache_work);
+
 	sbi->cache = plgfs_cache_get(cfg->plgs_nr);
 	if (IS_ERR(sbi->cache)) {
 		kfree(sbi);
 		return ERR_PTR(-ENOMEM);
 	}
 
+	sbi->cont_rcu = __alloc_percpu(sizeof(struct plgfs_context) +
+			sizeof(void *) * cfg->plgs_nr,
+			__alignof__(struct plgfs_context));
+	if (!sbi->cont_rcu) {
+		plgfs_cache_put(sbi->cache);
+		kfree(sbi);
+		return ERR_PTR(-ENOMEM);
+	}
+
 	sbi->plgs_nr = cfg->plgs_nr;
 	sbi->plgs = (struct plgfs_plugin **)sbi->data;
 	sbi->priv = sbi->data + sbi->plgs_nr;
 	mutex_init(&sbi->mutex_walk);
 
+	if (cfg->flags & PLGFS_OPT_PAGECACHE)
+		sbi->flags |= PLGFS_SBI_PAGECACHE;
+
+	if (cfg->flags & PLGFS_OPT_READDIRPLUS)
+		sbi->flags |= PLGFS_SBI_READDIRPLUS;
+
 	memcpy(sbi->plgs, cfg->plgs, sizeof(struct plgfs_plugin *) *
 			sbi->plgs_nr);
 
@@ -390,11 +529,56 @@ static struct plgfs_sb_info *plgfs_alloc_sbi(struct plgfs_mnt_cfg *cfg)
 		/* this should never fail since we grabbed all plgs in
 		   plgfs_get_cfg */
 		BUG_ON(!plgfs_get_plg(sbi->plgs[i]->name));
+
+		if (sbi->plgs[i]->flags & PLGFS_PLG_TRACK_DIRTY)
+			sbi->flags |= PLGFS_SBI_TRACK_DIRTY;
+
+		if (sbi->plgs[i]->flags & PLGFS_PLG_NO_RCU)
+			sbi->flags |= PLGFS_SBI_NO_RCU;
+
+		for (op = 0; op < PLGFS_OP_NR; op++) {
+			if (sbi->plgs[i]->cbs[op].pre ||
+					sbi->plgs[i]->cbs[op].post)
+				__set_bit(op, sbi->cbs);
+		}
+
+		if (!plgfs_has_data_cbs(sbi->plgs[i]))
+			continue;
+
+		/* plugins out of the mask can never clear themselves */
+		if (i >= BITS_PER_LONG)
+			sbi->data_plgs = ~0UL;
+		else
+			sbi->data_plgs |= 1UL << i;
 	}
 
 	return sbi;
 }
 
+/*
+ * When no plugin looks at the data being read, regular files can share the
+ * page cache of the hidden inodes and reads are done by the generic page
+ * cache code directly. This relies on readpage of the hidden fs not needing
+ * its own struct file, which holds for block device based filesystems.
+ * Everything else, writes and mmap included, still goes to the hidden file.
+ */
+static int plgfs_can_alias(struct plgfs_sb_info *sbi, struct super_block *sbh)
+{
+	if (sbi->flags & PLGFS_SBI_PAGECACHE)
+		return 0;
+
+	if (!sbh->s_bdev)
+		return 0;
+
+	if (plgfs_has_cbs(sbi, PLGFS_REG_FOP_READ) ||
+			plgfs_has_cbs(sbi, PLGFS_REG_FOP_AIO_READ) ||
+			plgfs_has_cbs(sbi, PLGFS_REG_FOP_SPLICE_READ) ||
+			plgfs_has_cbs(sbi, PLGFS_REG_FOP_READ_XFORM))
+		return 0;
+
+	return 1;
+}
+
 static void plgfs_cp_opts(struct plgfs_context *cont)
 {
 	char *opts_in;
@@ -426,7 +610,6 @@ int plgfs_fill_super(struct super_block *sb, int flags,
 
 	sb->s_fs_info = sbi;
 	sb->s_magic = PLGFS_MAGIC;
-	sb->s_d_op = &plgfs_dops;
 	sb->s_op = &plgfs_sops;
 
 	cont = plgfs_alloc_context(sbi);
@@ -488,6 +671,23 @@ int plgfs_fill_super(struct super_block *sb, int flags,
 
 	cont->op_args.t_mount.path = &sbi->path_hidden;
 
+	/* our dirty pages end up in the hidden fs, let its bdi write them */
+	if (sbi->flags & PLGFS_SBI_PAGECACHE)
+		sb->s_bdi = sbi->path_hidden.dentry->d_sb->s_bdi;
+
+	if (plgfs_can_alias(sbi, sbi->path_hidden.dentry->d_sb))
+		sbi->flags |= PLGFS_SBI_ALIAS;
+
+	/*
+	 * Block device based filesystems report in getattr what their inodes
+	 * hold, network ones may ask the server and are not cached.
+	 */
+	if (sbi->path_hidden.dentry->d_sb->s_bdev)
+		sbi->flags |= PLGFS_SBI_ATTR_CACHE;
+
+	/* before d_make_root, which sets it for the root dentry */
+	sb->s_d_op = plgfs_get_dops(sbi, drh);
+
 	ir = plgfs_iget(sb, (unsigned long)drh->d_inode);
 	if (IS_ERR(ir)) {
 		cont->op_rv.rv_int = PTR_ERR(ir);